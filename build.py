@@ -160,6 +160,55 @@ def xz(data):
     return lzma.compress(data, preset=9, check=lzma.CHECK_NONE)
 
 
+def lz4(data):
+    # LZ4 block format, prefixed with the uncompressed size (u32 LE)
+    out = bytearray(len(data).to_bytes(4, "little"))
+
+    def write_len(n):
+        while n >= 255:
+            out.append(255)
+            n -= 255
+        out.append(n)
+
+    def write_seq(literals, match_len=0, offset=0):
+        lit_len = len(literals)
+        ml = match_len - 4 if match_len else 0
+        out.append((min(lit_len, 15) << 4) | min(ml, 15))
+        if lit_len >= 15:
+            write_len(lit_len - 15)
+        out.extend(literals)
+        if match_len:
+            out.extend(offset.to_bytes(2, "little"))
+            if ml >= 15:
+                write_len(ml - 15)
+
+    n = len(data)
+    table = {}
+    anchor = i = 0
+    # The last match must start at least 12 bytes before the end,
+    # and the last 5 bytes are always literals
+    while i < n - 12:
+        key = data[i : i + 4]
+        cand = table.get(key)
+        table[key] = i
+        if cand is None or i - cand > 0xFFFF:
+            i += 1
+            continue
+        m = 4
+        while i + m < n - 5 and data[cand + m] == data[i + m]:
+            m += 1
+        write_seq(data[anchor:i], m, i - cand)
+        i += m
+        anchor = i
+    write_seq(data[anchor:])
+    return bytes(out)
+
+
+# Codec used for each compressed binary embedded in magiskinit.
+# xz is smaller, lz4 is much faster to decompress on the boot critical path.
+embed_codecs = {"init_ld": "lz4"}
+
+
 def parse_props(file):
     props = {}
     with open(file, "r") as f:
@@ -326,12 +375,19 @@ def binary_dump(src, var_name, compressor=xz):
     return out_str
 
 
+def embed_dump(src, var_name):
+    codec = embed_codecs.get(var_name, "xz")
+    out_str = binary_dump(src, var_name, compressor=globals()[codec])
+    out_str += f"constexpr embed_codec {var_name}_codec = embed_codec::{codec.upper()};\n"
+    return out_str
+
+
 def dump_bin_header(args):
     mkdir_p(native_gen_path)
     for arch in archs:
         preload = op.join("native", "out", arch, "libinit-ld.so")
         with open(preload, "rb") as src:
-            text = binary_dump(src, "init_ld_xz")
+            text = embed_dump(src, "init_ld")
         preload = op.join("native", "out", arch, "libzygisk-ld.so")
         with open(preload, "rb") as src:
             text += binary_dump(src, "zygisk_ld", compressor=lambda x: x)
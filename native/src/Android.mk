@@ -30,6 +30,7 @@ LOCAL_SRC_FILES := \
     core/restorecon.cpp \
     core/module.cpp \
     core/thread.cpp \
+    core/stats.cpp \
     core/resetprop/persist.cpp \
     core/resetprop/resetprop.cpp \
     core/core-rs.cpp \
@@ -78,6 +79,7 @@ LOCAL_STATIC_LIBRARIES := \
     libcompat \
     libpolicy \
     libxz \
+    liblz4 \
     libinit-rs
 
 LOCAL_SRC_FILES := \
@@ -95,11 +95,21 @@ int mkfifo(const char *path, mode_t mode) {
 int ftruncate64(int fd, off64_t length) {
     return syscall(__NR_ftruncate64, fd, 0, SPLIT_64(length));
 }
+
+[[gnu::weak]]
+int fallocate64(int fd, int mode, off64_t offset, off64_t length) {
+    return syscall(__NR_fallocate, fd, mode, SPLIT_64(offset), SPLIT_64(length));
+}
 #elif defined(__i386__)
 [[gnu::weak]]
 int ftruncate64(int fd, off64_t length) {
     return syscall(__NR_ftruncate64, fd, SPLIT_64(length));
 }
+
+[[gnu::weak]]
+int fallocate64(int fd, int mode, off64_t offset, off64_t length) {
+    return syscall(__NR_fallocate, fd, mode, SPLIT_64(offset), SPLIT_64(length));
+}
 #endif
 
 [[gnu::weak]]
@@ -117,6 +117,43 @@ void mv_dir(int src, int dest) {
     }
 }
 
+ssize_t copy_range(int out_fd, off64_t out_off, int in_fd, off64_t in_off, size_t len) {
+    if (len == 0)
+        return 0;
+
+    // Share extents if the filesystem supports reflinks
+    file_clone_range range {
+        .src_fd = in_fd,
+        .src_offset = (uint64_t) in_off,
+        .src_length = len,
+        .dest_offset = (uint64_t) out_off,
+    };
+    if (ioctl(out_fd, FICLONERANGE, &range) == 0)
+        return len;
+
+    // In-kernel copy, which filesystems can offload
+    size_t done = 0;
+    while (done < len) {
+        off64_t src = in_off + done;
+        off64_t dst = out_off + done;
+        auto ret = syscall(__NR_copy_file_range, in_fd, &src, out_fd, &dst, len - done, 0);
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    // Fallback to sendfile
+    if (done < len) {
+        off_t src = in_off + done;
+        lseek64(out_fd, out_off + done, SEEK_SET);
+        auto ret = xsendfile(out_fd, in_fd, &src, len - done);
+        if (ret < 0)
+            return done ? done : -1;
+        done += ret;
+    }
+    return done;
+}
+
 void cp_afc(const char *src, const char *dest) {
     file_attr a;
     getattr(src, &a);
@@ -129,7 +166,7 @@ void cp_afc(const char *src, const char *dest) {
         if (S_ISREG(a.st.st_mode)) {
             int sfd = xopen(src, O_RDONLY | O_CLOEXEC);
             int dfd = xopen(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0);
-            xsendfile(dfd, sfd, nullptr, a.st.st_size);
+            copy_range(dfd, 0, sfd, 0, a.st.st_size);
             close(sfd);
             close(dfd);
         } else if (S_ISLNK(a.st.st_mode)) {
@@ -159,7 +196,7 @@ void clone_dir(int src, int dest) {
             case DT_REG: {
                 int sfd = xopenat(src, entry->d_name, O_RDONLY | O_CLOEXEC);
                 int dfd = xopenat(dest, entry->d_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0);
-                xsendfile(dfd, sfd, nullptr, a.st.st_size);
+                copy_range(dfd, 0, sfd, 0, a.st.st_size);
                 fsetattr(dfd, &a);
                 close(dfd);
                 close(sfd);
@@ -302,49 +339,20 @@ void write_zero(int fd, size_t size) {
 void file_readline(bool trim, FILE *fp, const function<bool(string_view)> &fn) {
     size_t len = 1024;
     char *buf = (char *) malloc(len);
-    char *start;
     ssize_t read;
     while ((read = getline(&buf, &len, fp)) >= 0) {
-        start = buf;
-        if (trim) {
-            while (read && "\n\r "sv.find(buf[read - 1]) != string::npos)
-                --read;
-            buf[read] = '\0';
-            while (*start == ' ')
-                ++start;
-        }
-        if (!fn(start))
+        if (!for_each_line(trim, buf, read, fn))
             break;
     }
     free(buf);
 }
 
-void file_readline(bool trim, const char *file, const function<bool(string_view)> &fn) {
-    if (auto fp = open_file(file, "re"))
-        file_readline(trim, fp.get(), fn);
-}
-void file_readline(const char *file, const function<bool(string_view)> &fn) {
-    file_readline(false, file, fn);
-}
-
 void parse_prop_file(FILE *fp, const function<bool(string_view, string_view)> &fn) {
-    file_readline(true, fp, [&](string_view line_view) -> bool {
-        char *line = (char *) line_view.data();
-        if (line[0] == '#')
-            return true;
-        char *eql = strchr(line, '=');
-        if (eql == nullptr || eql == line)
-            return true;
-        *eql = '\0';
-        return fn(line, eql + 1);
+    file_readline(true, fp, [&](string_view line) -> bool {
+        return parse_prop_line(line, fn);
     });
 }
 
-void parse_prop_file(const char *file, const function<bool(string_view, string_view)> &fn) {
-    if (auto fp = open_file(file, "re"))
-        parse_prop_file(fp.get(), fn);
-}
-
 std::vector<mount_info> parse_mount_info(const char *pid) {
     char buf[PATH_MAX] = {};
     ssprintf(buf, sizeof(buf), "/proc/%s/mountinfo", pid);
@@ -433,20 +441,70 @@ sFILE make_file(FILE *fp) {
     return sFILE(fp, [](FILE *fp){ return fp ? fclose(fp) : 1; });
 }
 
+byte_matcher::byte_matcher(const vector<string_view> &patterns) {
+    states.emplace_back();
+    // Build the trie, using 0 in next[] as "no transition" for now
+    for (int idx = 0; idx < patterns.size(); ++idx) {
+        auto pattern = patterns[idx];
+        uint32_t s = 0;
+        for (uint8_t c : pattern) {
+            if (states[s].next[c] == 0) {
+                states[s].next[c] = states.size();
+                states.emplace_back();
+            }
+            s = states[s].next[c];
+        }
+        states[s].out.push_back(idx);
+        lens.push_back(pattern.size());
+    }
+    // BFS to resolve failure links into a full transition table
+    vector<uint32_t> fail(states.size(), 0);
+    vector<uint32_t> queue;
+    for (uint32_t s : states[0].next) {
+        if (s) queue.push_back(s);
+    }
+    for (size_t i = 0; i < queue.size(); ++i) {
+        uint32_t s = queue[i];
+        auto &out = states[s].out;
+        auto &fail_out = states[fail[s]].out;
+        out.insert(out.end(), fail_out.begin(), fail_out.end());
+        for (int c = 0; c < 256; ++c) {
+            uint32_t t = states[s].next[c];
+            if (t) {
+                fail[t] = states[fail[s]].next[c];
+                queue.push_back(t);
+            } else {
+                states[s].next[c] = states[fail[s]].next[c];
+            }
+        }
+    }
+}
+
 int byte_data::patch(bool log, str_pairs list) {
     if (buf == nullptr)
         return 0;
+    // Patterns are matched including their null terminator
+    vector<string_view> patterns;
+    for (auto [from, to] : list)
+        patterns.emplace_back(from.data(), from.length() + 1);
+    vector<pair<size_t, int>> matches;
+    byte_matcher(patterns).scan(buf, sz, [&](int idx, size_t off) -> bool {
+        matches.emplace_back(off, idx);
+        return true;
+    });
+    // Apply leftmost non-overlapping matches, earlier patterns win on ties
+    sort(matches.begin(), matches.end());
     int count = 0;
-    for (uint8_t *p = buf, *eof = buf + sz; p < eof; ++p) {
-        for (auto [from, to] : list) {
-            if (memcmp(p, from.data(), from.length() + 1) == 0) {
-                if (log) LOGD("Replace [%s] -> [%s]\n", from.data(), to.data());
-                memset(p, 0, from.length());
-                memcpy(p, to.data(), to.length());
-                ++count;
-                p += from.length();
-            }
-        }
+    size_t end = 0;
+    for (auto [off, idx] : matches) {
+        if (off < end)
+            continue;
+        auto [from, to] = list.begin()[idx];
+        if (log) LOGD("Replace [%s] -> [%s]\n", from.data(), to.data());
+        memset(buf + off, 0, from.length());
+        memcpy(buf + off, to.data(), to.length());
+        ++count;
+        end = off + patterns[idx].length();
     }
     return count;
 }
@@ -454,11 +512,9 @@ int byte_data::patch(bool log, str_pairs list) {
 bool byte_data::contains(string_view pattern, bool log) const {
     if (buf == nullptr)
         return false;
-    for (uint8_t *p = buf, *eof = buf + sz; p < eof; ++p) {
-        if (memcmp(p, pattern.data(), pattern.length() + 1) == 0) {
-            if (log) LOGD("Found pattern [%s]\n", pattern.data());
-            return true;
-        }
+    if (memmem(buf, sz, pattern.data(), pattern.length() + 1) != nullptr) {
+        if (log) LOGD("Found pattern [%s]\n", pattern.data());
+        return true;
     }
     return false;
 }
@@ -468,6 +524,66 @@ void byte_data::swap(byte_data &o) {
     std::swap(sz, o.sz);
 }
 
+// Smaller files are read instead of mapped: a prop or rc file truncated by a script
+// while it is parsed must result in a short read, not SIGBUS
+#define TEXT_MAP_MIN (64 * 1024)
+
+text_data::text_data(const char *name) {
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // Optional files are probed all the time, only report actual errors
+        if (errno != ENOENT)
+            PLOGE("open %s", name);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= TEXT_MAP_MIN) {
+        // Reserve an extra byte for the terminator, then map the file over the front
+        size_t len = st.st_size;
+        void *b = xmmap(nullptr, len + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b && mmap(b, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+            buf = static_cast<uint8_t *>(b);
+            sz = len;
+            close(fd);
+            return;
+        }
+        if (b)
+            munmap(b, len + 1);
+    }
+
+    // Read until EOF, the size of procfs and sysfs files is unknown
+    size_t cap = getpagesize();
+    void *b = xmmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t len = 0;
+    while (b) {
+        if (len + 1 == cap) {
+            void *nb = mremap(b, cap, cap * 2, MREMAP_MAYMOVE);
+            if (nb == MAP_FAILED) {
+                munmap(b, cap);
+                b = nullptr;
+                break;
+            }
+            b = nb;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, static_cast<char *>(b) + len, cap - 1 - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            PLOGE("read %s", name);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    close(fd);
+    if (b) {
+        // Release the unused tail so that the destructor unmaps everything
+        void *nb = mremap(b, cap, len + 1, 0);
+        buf = static_cast<uint8_t *>(nb == MAP_FAILED ? b : nb);
+        sz = len;
+    }
+}
+
 mmap_data::mmap_data(const char *name, bool rw) {
     int fd = xopen(name, (rw ? O_RDWR : O_RDONLY) | O_CLOEXEC);
     if (fd < 0)
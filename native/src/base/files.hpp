@@ -3,6 +3,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <mntent.h>
+#include <cstring>
 #include <functional>
 #include <string_view>
 #include <string>
@@ -43,6 +44,34 @@ struct mount_info {
     std::string fs_option;
 };
 
+// Aho-Corasick automaton over raw bytes.
+// Compile once per pattern set, then find all occurrences of every pattern in a single pass.
+class byte_matcher {
+public:
+    explicit byte_matcher(const std::vector<std::string_view> &patterns);
+
+    // fn(index, offset) is called for every match in order of its end position.
+    // Return false from fn to stop scanning.
+    template <typename Func>
+    void scan(const uint8_t *buf, size_t sz, Func &&fn) const {
+        uint32_t s = 0;
+        for (size_t i = 0; i < sz; ++i) {
+            s = states[s].next[buf[i]];
+            for (int idx : states[s].out) {
+                if (!fn(idx, i + 1 - lens[idx]))
+                    return;
+            }
+        }
+    }
+private:
+    struct state {
+        uint32_t next[256];
+        std::vector<int> out;
+    };
+    std::vector<state> states;
+    std::vector<size_t> lens;
+};
+
 struct byte_data {
     using str_pairs = std::initializer_list<std::pair<std::string_view, std::string_view>>;
 
@@ -76,6 +105,50 @@ struct mmap_data : public byte_data {
     ~mmap_data() { if (buf) munmap(buf, sz); }
 };
 
+// Private writable copy of a file with a NUL byte after its end, so it can be split
+// into C strings in place. Large regular files are mapped, everything else
+// (small files, procfs and sysfs) is read into an anonymous mapping.
+struct text_data : public byte_data {
+    MOVE_ONLY(text_data)
+
+    explicit text_data(const char *name);
+    ~text_data() { if (buf) munmap(buf, sz + 1); }
+};
+
+// Calls fn with every line of buf until it returns false, which is also the return value.
+// buf[sz] has to be writable, and every view passed to fn is also a valid C string.
+// Trim strips the line break and surrounding spaces and CR, replacing the end with NUL.
+// Without trim the line break is kept, and the byte after it reads NUL while fn runs.
+template <typename Func>
+bool for_each_line(bool trim, char *buf, size_t sz, Func &&fn) {
+    char *end = buf + sz;
+    *end = '\0';
+    for (char *line = buf; line < end;) {
+        auto eol = static_cast<char *>(memchr(line, '\n', end - line));
+        char *next = eol ? eol + 1 : end;
+        if (trim) {
+            if (eol == nullptr)
+                eol = end;
+            while (eol > line && (eol[-1] == '\r' || eol[-1] == ' '))
+                --eol;
+            while (line < eol && *line == ' ')
+                ++line;
+            *eol = '\0';
+            if (!fn(std::string_view(line, eol - line)))
+                return false;
+        } else {
+            char c = *next;
+            *next = '\0';
+            bool ret = fn(std::string_view(line, next - line));
+            *next = c;
+            if (!ret)
+                return false;
+        }
+        line = next;
+    }
+    return true;
+}
+
 extern "C" {
 
 int mkdirs(const char *path, mode_t mode);
@@ -88,6 +161,9 @@ int fd_pathat(int dirfd, const char *name, char *path, size_t size);
 void rm_rf(const char *path);
 void mv_path(const char *src, const char *dest);
 void mv_dir(int src, int dest);
+// Copy len bytes between explicit offsets. Tries a reflink, then copy_file_range,
+// and finally sendfile, which may leave out_fd's file offset modified.
+ssize_t copy_range(int out_fd, off64_t out_off, int in_fd, off64_t in_off, size_t len);
 void cp_afc(const char *src, const char *dest);
 void link_path(const char *src, const char *dest);
 void link_dir(int src, int dest);
@@ -109,11 +185,34 @@ std::string full_read(int fd);
 std::string full_read(const char *filename);
 void write_zero(int fd, size_t size);
 void file_readline(bool trim, FILE *fp, const std::function<bool(std::string_view)> &fn);
-void file_readline(bool trim, const char *file, const std::function<bool(std::string_view)> &fn);
-void file_readline(const char *file, const std::function<bool(std::string_view)> &fn);
 void parse_prop_file(FILE *fp, const std::function<bool(std::string_view, std::string_view)> &fn);
-void parse_prop_file(const char *file,
-        const std::function<bool(std::string_view, std::string_view)> &fn);
+template <typename Func>
+void file_readline(bool trim, const char *file, Func &&fn) {
+    text_data data(file);
+    if (data.buf)
+        for_each_line(trim, reinterpret_cast<char *>(data.buf), data.sz, fn);
+}
+template <typename Func>
+void file_readline(const char *file, Func &&fn) {
+    file_readline(false, file, fn);
+}
+// Shared by both overloads of parse_prop_file, fn is called with NUL terminated views
+template <typename Func>
+bool parse_prop_line(std::string_view line, Func &&fn) {
+    if (line.empty() || line[0] == '#')
+        return true;
+    size_t eql = line.find('=');
+    if (eql == std::string_view::npos || eql == 0)
+        return true;
+    const_cast<char *>(line.data())[eql] = '\0';
+    return fn(line.substr(0, eql), line.substr(eql + 1));
+}
+template <typename Func>
+void parse_prop_file(const char *file, Func &&fn) {
+    file_readline(true, file, [&](std::string_view line) -> bool {
+        return parse_prop_line(line, fn);
+    });
+}
 void frm_rf(int dirfd);
 void clone_dir(int src, int dest);
 std::vector<mount_info> parse_mount_info(const char *pid);
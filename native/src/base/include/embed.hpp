@@ -1,3 +1,11 @@
+#pragma once
+
+// Compression formats of binaries embedded by build.py
+enum class embed_codec {
+    XZ,
+    LZ4,
+};
+
 #if defined(__arm__)
 #include <armeabi-v7a_binaries.h>
 #elif defined(__aarch64__)
@@ -2,6 +2,8 @@
 #include <sys/wait.h>
 #include <sys/prctl.h>
 #include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <pwd.h>
 #include <unistd.h>
@@ -65,6 +67,134 @@ int gen_rand_str(char *buf, int len, bool varlen) {
     return len - 1;
 }
 
+// The environment of the caller with the entries of exec.env replacing or added to it
+static vector<const char *> build_env(const exec_t &exec) {
+    vector<const char *> envp;
+    for (char **e = environ; *e; ++e) {
+        string_view name(*e);
+        name = name.substr(0, name.find('='));
+        bool replaced = false;
+        for (auto v = exec.env; v && *v; ++v) {
+            if (strncmp(*v, name.data(), name.size()) == 0 && (*v)[name.size()] == '=') {
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced)
+            envp.push_back(*e);
+    }
+    for (auto v = exec.env; v && *v; ++v)
+        envp.push_back(*v);
+    envp.push_back(nullptr);
+    return envp;
+}
+
+struct spawn_args {
+    const exec_t *exec;
+    const char * const *envp;
+    int outfd;
+    bool no_orphan;
+    // Stack for the grandchild, only set when the child should be detached
+    char *detach_stack;
+    // Set by the child if it failed before execve succeeded
+    int error;
+};
+
+// Runs with the memory of the parent while the parent is suspended.
+// Only raw syscalls are allowed here: no allocation, no locks, no logging.
+static int spawn_child(void *p) {
+    auto args = static_cast<spawn_args *>(p);
+    auto &exec = *args->exec;
+
+    if (args->detach_stack) {
+        // Exit right away, the grandchild gets reparented and we are reaped by the caller
+        char *stack = args->detach_stack;
+        args->detach_stack = nullptr;
+        if (clone(spawn_child, stack, CLONE_VM | CLONE_VFORK | SIGCHLD, args) < 0)
+            args->error = errno;
+        _exit(0);
+    }
+
+    // Signal handlers live in the memory of the parent, never run them here
+    for (int sig = 1; sig < _NSIG; ++sig) {
+        struct sigaction sa{};
+        if (sigaction(sig, nullptr, &sa) == 0 && sa.sa_handler != SIG_IGN) {
+            sa.sa_handler = SIG_DFL;
+            sigaction(sig, &sa, nullptr);
+        }
+    }
+    // Unblock all signals
+    sigset_t set;
+    sigemptyset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, nullptr);
+
+    if (args->no_orphan) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() == 1)
+            _exit(1);
+    }
+    if (args->outfd >= 0) {
+        if (dup2(args->outfd, STDOUT_FILENO) < 0)
+            goto error;
+        if (exec.err && dup2(args->outfd, STDERR_FILENO) < 0)
+            goto error;
+        close(args->outfd);
+    }
+
+    execve(exec.argv[0], (char **) exec.argv, (char **) args->envp);
+
+error:
+    args->error = errno;
+    _exit(-1);
+}
+
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+static int spawn_command(const exec_t &exec, int outfd) {
+    auto envp = build_env(exec);
+    spawn_args args {
+        .exec = &exec,
+        .envp = envp.data(),
+        .outfd = outfd,
+        .no_orphan = exec.fork == fork_no_orphan,
+        .detach_stack = nullptr,
+        .error = 0,
+    };
+
+    void *stack = xmmap(nullptr, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == nullptr)
+        return -1;
+    // Stacks grow down, the lower half is for the grandchild
+    char *stack_top = static_cast<char *>(stack) + SPAWN_STACK_SIZE;
+    if (exec.fork == fork_dont_care)
+        args.detach_stack = static_cast<char *>(stack) + SPAWN_STACK_SIZE / 2;
+
+    // The child shares our signal handlers until it resets them
+    sigset_t set, old;
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old);
+    int pid = clone(spawn_child, stack_top, CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+    int clone_errno = errno;
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    // CLONE_VFORK: the child has either called execve or exited at this point
+    munmap(stack, SPAWN_STACK_SIZE);
+
+    if (pid < 0) {
+        errno = clone_errno;
+        PLOGE("clone");
+        return -1;
+    }
+    if (exec.fork == fork_dont_care)
+        waitpid(pid, nullptr, 0);
+    if (args.error) {
+        errno = args.error;
+        PLOGE("execve %s", exec.argv[0]);
+    }
+    return pid;
+}
+
 int exec_command(exec_t &exec) {
     auto pipefd = array<int, 2>{-1, -1};
     int outfd = -1;
@@ -77,7 +207,10 @@ int exec_command(exec_t &exec) {
         outfd = exec.fd;
     }
 
-    int pid = exec.fork();
+    // Only fork when a callback has to run in a copy of our address space
+    bool spawn = exec.pre_exec == nullptr &&
+            (exec.fork == xfork || exec.fork == fork_dont_care || exec.fork == fork_no_orphan);
+    int pid = spawn ? spawn_command(exec, outfd) : exec.fork();
     if (pid < 0) {
         close(pipefd[0]);
         close(pipefd[1]);
@@ -106,7 +239,8 @@ int exec_command(exec_t &exec) {
     if (exec.pre_exec)
         exec.pre_exec();
 
-    execve(exec.argv[0], (char **) exec.argv, environ);
+    auto envp = build_env(exec);
+    execve(exec.argv[0], (char **) exec.argv, (char **) envp.data());
     PLOGE("execve %s", exec.argv[0]);
     exit(-1);
 }
@@ -6,6 +6,8 @@
 #include <string_view>
 #include <bitset>
 #include <random>
+#include <atomic>
+#include <thread>
 
 #define DISALLOW_COPY_AND_MOVE(clazz) \
 clazz(const clazz &) = delete; \
@@ -132,6 +134,24 @@ rust::Slice<const uint8_t> u8_slice(T *buf, size_t sz) {
 uint64_t parse_uint64_hex(std::string_view s);
 int parse_int(std::string_view s);
 
+// Run fn(i) for every i in [0, n) on a temporary pool of threads, including the calling one.
+// Each thread is given at least grain items so that small inputs stay single threaded.
+template <typename Func>
+void parallel_for(size_t n, Func &&fn, size_t grain = 1) {
+    std::atomic_size_t next = 0;
+    auto worker = [&] {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+            fn(i);
+    };
+    size_t num = std::min<size_t>(std::thread::hardware_concurrency(), n / grain);
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < num; ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+}
+
 using thread_entry = void *(*)(void *);
 extern "C" int new_daemon_thread(thread_entry entry, void *arg = nullptr);
 
@@ -182,12 +202,17 @@ extern "C" size_t strscpy(char *dest, const char *src, size_t size);
 #define snprintf   __use_ssprintf_instead__
 #define strlcpy    __use_strscpy_instead__
 
+// Unless pre_exec or a custom fork function is set, the child is spawned without
+// copying the address space of the caller. Everything the child needs has to be
+// described here instead of done in a pre_exec callback.
 struct exec_t {
     bool err = false;
     int fd = -2;
     void (*pre_exec)() = nullptr;
     int (*fork)() = xfork;
     const char **argv = nullptr;
+    // NAME=VALUE entries added to the environment, terminated by nullptr
+    const char * const *env = nullptr;
 };
 
 int exec_command(exec_t &exec);
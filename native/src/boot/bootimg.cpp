@@ -23,14 +23,13 @@ static void decompress(format_t type, int fd, const void *in, size_t size) {
     ptr->write(in, size);
 }
 
-static off_t compress(format_t type, int fd, const void *in, size_t size) {
-    auto prev = lseek(fd, 0, SEEK_CUR);
+static heap_data compress(format_t type, const void *in, size_t size) {
+    heap_data out;
     {
-        auto strm = get_encoder(type, make_unique<fd_channel>(fd));
+        auto strm = get_encoder(type, make_unique<byte_channel>(out));
         strm->write(in, size);
     }
-    auto now = lseek(fd, 0, SEEK_CUR);
-    return now - prev;
+    return out;
 }
 
 static void dump(const void *buf, size_t size, const char *filename) {
@@ -41,15 +40,111 @@ static void dump(const void *buf, size_t size, const char *filename) {
     close(fd);
 }
 
-static size_t restore(int fd, const char *filename) {
-    int ifd = xopen(filename, O_RDONLY);
-    size_t size = lseek(ifd, 0, SEEK_END);
-    lseek(ifd, 0, SEEK_SET);
-    xsendfile(fd, ifd, nullptr, size);
-    close(ifd);
-    return size;
+// Dump a region of an image file without copying it through the mapping
+static void dump(int img_fd, const byte_data &img, const void *buf, size_t size, const char *filename) {
+    if (size == 0)
+        return;
+    int fd = creat(filename, 0644);
+    copy_range(fd, 0, img_fd, static_cast<const uint8_t *>(buf) - img.buf, size);
+    close(fd);
 }
 
+// The complete layout of an output image, computed before anything is written.
+// Gaps between chunks are padding, which the preallocated file already reads as zeros.
+class img_layout {
+public:
+    size_t pos = 0;
+
+    img_layout() = default;
+    img_layout(const img_layout &) = delete;
+    ~img_layout() {
+        for (auto &c : chunks) {
+            if (c.fd >= 0)
+                close(c.fd);
+        }
+    }
+
+    // buf has to stay valid until commit
+    size_t add(const void *buf, size_t sz) {
+        if (sz)
+            chunks.push_back({ pos, static_cast<const uint8_t *>(buf), sz, -1 });
+        pos += sz;
+        return sz;
+    }
+    size_t add(heap_data &&data) {
+        size_t sz = add(data.buf, data.sz);
+        owned.push_back(std::move(data));
+        return sz;
+    }
+    size_t copy(const void *buf, size_t sz) {
+        heap_data data(sz);
+        memcpy(data.buf, buf, sz);
+        return add(std::move(data));
+    }
+    size_t add_file(const char *filename) {
+        int fd = xopen(filename, O_RDONLY | O_CLOEXEC);
+        struct stat st{};
+        fstat(fd, &st);
+        if (st.st_size)
+            chunks.push_back({ pos, nullptr, (size_t) st.st_size, fd });
+        else
+            close(fd);
+        pos += st.st_size;
+        return st.st_size;
+    }
+    // Drop everything at or beyond off
+    void truncate(size_t off) {
+        while (!chunks.empty() && chunks.back().off >= off) {
+            if (chunks.back().fd >= 0)
+                close(chunks.back().fd);
+            chunks.pop_back();
+        }
+        pos = off;
+    }
+
+    // Allocate the output file in one go and fill it through a shared mapping
+    mmap_data commit(const char *filename, size_t min_sz) {
+        int fd = xopen(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            exit(1);
+        off64_t sz = std::max(pos, min_sz);
+        if (fallocate64(fd, 0, 0, sz) != 0)
+            ftruncate64(fd, sz);
+        // Component files never pass through userspace
+        for (auto &c : chunks) {
+            if (c.fd >= 0) {
+                if (copy_range(fd, c.off, c.fd, 0, c.sz) != (ssize_t) c.sz) {
+                    LOGE("Cannot copy %zu bytes into [%s]\n", c.sz, filename);
+                    exit(1);
+                }
+                close(c.fd);
+                c.fd = -1;
+            }
+        }
+        close(fd);
+
+        mmap_data out(filename, true);
+        if (out.buf == nullptr || out.sz < pos)
+            exit(1);
+        for (auto &c : chunks) {
+            if (c.buf)
+                memcpy(out.buf + c.off, c.buf, c.sz);
+        }
+        return out;
+    }
+
+private:
+    struct chunk {
+        size_t off;
+        const uint8_t *buf;
+        size_t sz;
+        // Component files are copied from their fd instead of buf
+        int fd;
+    };
+    vector<chunk> chunks;
+    vector<heap_data> owned;
+};
+
 void dyn_img_hdr::print() {
     uint32_t ver = header_version();
     fprintf(stderr, "%-*s [%u]\n", PADDING, "HEADER_VER", ver);
@@ -151,6 +246,8 @@ void dyn_img_hdr::load_hdr_file() {
 
 boot_img::boot_img(const char *image) : map(image) {
     fprintf(stderr, "Parsing boot image: [%s]\n", image);
+    if (load_index(image))
+        return;
     for (const uint8_t *addr = map.buf; addr < map.buf + map.sz; ++addr) {
         format_t fmt = check_fmt(addr, map.sz);
         switch (fmt) {
@@ -321,6 +418,8 @@ if (hdr->name##_size()) {                                           \
 }
 
 void boot_img::parse_image(const uint8_t *addr, format_t type) {
+    img_addr = addr;
+    img_type = type;
     hdr = create_hdr(addr, type);
 
     if (char *id = hdr->id()) {
@@ -453,6 +552,164 @@ void boot_img::parse_image(const uint8_t *addr, format_t type) {
     }
 }
 
+static bool index_stat(const char *image, struct stat *st) {
+    if (stat(image, st) != 0)
+        return false;
+    // Block devices have no meaningful mtime to validate the cache with
+    return S_ISREG(st->st_mode);
+}
+
+bool boot_img::save_index(const char *image) const {
+    struct stat st;
+    if (!index_stat(image, &st))
+        return false;
+
+    auto off = [this](const void *p) -> uint64_t {
+        return p ? static_cast<const uint8_t *>(p) - map.buf : BOOT_INDEX_NONE;
+    };
+
+    boot_index idx{};
+    memcpy(idx.magic, BOOT_INDEX_MAGIC, sizeof(idx.magic));
+    idx.version = BOOT_INDEX_VERSION;
+    idx.img_size = map.sz;
+    idx.img_mtime_sec = st.st_mtim.tv_sec;
+    idx.img_mtime_nsec = st.st_mtim.tv_nsec;
+    idx.hdr_hash_size = std::min<const uint8_t *>(hdr_addr + hdr->hdr_space(), map.buf + map.sz) - img_addr;
+    SHA_hash(img_addr, idx.hdr_hash_size, idx.hdr_hash);
+    idx.flags = flags.to_ullong();
+    idx.img_type = img_type;
+    idx.k_fmt = k_fmt;
+    idx.r_fmt = r_fmt;
+    idx.e_fmt = e_fmt;
+    idx.kernel_size = hdr->kernel_size();
+    idx.kernel_dt_size = hdr->kernel_dt_size;
+    idx.ramdisk_size = hdr->ramdisk_size();
+    idx.z_hdr_sz = z_info.hdr_sz;
+    idx.z_tail_sz = z_info.tail_sz;
+    idx.second_size = hdr->second_size();
+    idx.extra_size = hdr->extra_size();
+    idx.recovery_dtbo_size = hdr->recovery_dtbo_size();
+    idx.dtb_size = hdr->dtb_size();
+    idx.img = off(img_addr);
+    idx.k_hdr = off(k_hdr);
+    idx.r_hdr = off(r_hdr);
+    idx.z_hdr = off(z_hdr);
+    idx.z_tail = off(z_info.tail);
+    idx.kernel_dtb = off(kernel_dtb);
+    idx.tail = off(tail);
+    idx.tail_size = tail_size;
+    idx.avb_footer = off(avb_footer);
+    idx.vbmeta = off(vbmeta);
+    idx.kernel = off(kernel);
+    idx.ramdisk = off(ramdisk);
+    idx.second = off(second);
+    idx.extra = off(extra);
+    idx.recovery_dtbo = off(recovery_dtbo);
+    idx.dtb = off(dtb);
+    idx.ignore = off(ignore);
+    idx.ignore_size = ignore_size;
+
+    string file = string(image) + BOOT_INDEX_SUFFIX;
+    int fd = xopen(file.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = xwrite(fd, &idx, sizeof(idx)) == sizeof(idx);
+    close(fd);
+    return ok;
+}
+
+bool boot_img::load_index(const char *image) {
+    struct stat st;
+    if (map.buf == nullptr || !index_stat(image, &st))
+        return false;
+
+    string file = string(image) + BOOT_INDEX_SUFFIX;
+    int fd = open(file.data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    boot_index idx{};
+    bool ok = read(fd, &idx, sizeof(idx)) == sizeof(idx);
+    close(fd);
+
+    // Only trust an index that matches the current image exactly
+    if (!ok || memcmp(idx.magic, BOOT_INDEX_MAGIC, sizeof(idx.magic)) != 0 ||
+        idx.version != BOOT_INDEX_VERSION || idx.img_size != map.sz ||
+        idx.img_mtime_sec != st.st_mtim.tv_sec || idx.img_mtime_nsec != st.st_mtim.tv_nsec ||
+        idx.img >= map.sz || (idx.img_type != AOSP && idx.img_type != AOSP_VENDOR)) {
+        return false;
+    }
+
+    // Every recorded section has to lie within the image
+    auto fits = [this](uint64_t off, uint64_t len) -> bool {
+        return off == BOOT_INDEX_NONE || (off <= map.sz && len <= map.sz - off);
+    };
+    if (!fits(idx.img, idx.hdr_hash_size) ||
+        !fits(idx.k_hdr, sizeof(mtk_hdr)) || !fits(idx.r_hdr, sizeof(mtk_hdr)) ||
+        !fits(idx.z_hdr, idx.z_hdr_sz) || !fits(idx.z_tail, idx.z_tail_sz) ||
+        !fits(idx.kernel_dtb, idx.kernel_dt_size) || !fits(idx.tail, idx.tail_size) ||
+        !fits(idx.avb_footer, sizeof(AvbFooter)) ||
+        !fits(idx.vbmeta, sizeof(AvbVBMetaImageHeader)) ||
+        !fits(idx.kernel, idx.kernel_size) || !fits(idx.ramdisk, idx.ramdisk_size) ||
+        !fits(idx.second, idx.second_size) || !fits(idx.extra, idx.extra_size) ||
+        !fits(idx.recovery_dtbo, idx.recovery_dtbo_size) || !fits(idx.dtb, idx.dtb_size) ||
+        !fits(idx.ignore, idx.ignore_size)) {
+        return false;
+    }
+
+    // Size and mtime can be preserved across a rewrite, so also compare the header page
+    uint8_t hash[SHA_DIGEST_SIZE];
+    SHA_hash(map.buf + idx.img, idx.hdr_hash_size, hash);
+    if (memcmp(hash, idx.hdr_hash, sizeof(hash)) != 0)
+        return false;
+
+    auto ptr = [this](uint64_t off) -> const uint8_t * {
+        return off < map.sz ? map.buf + off : nullptr;
+    };
+
+    fprintf(stderr, "Using boot image index: [%s]\n", file.data());
+    img_addr = ptr(idx.img);
+    img_type = static_cast<format_t>(idx.img_type);
+    hdr = create_hdr(img_addr, img_type);
+    hdr->print();
+
+    flags = idx.flags;
+    k_fmt = static_cast<format_t>(idx.k_fmt);
+    r_fmt = static_cast<format_t>(idx.r_fmt);
+    e_fmt = static_cast<format_t>(idx.e_fmt);
+    hdr->kernel_size() = idx.kernel_size;
+    hdr->kernel_dt_size = idx.kernel_dt_size;
+    hdr->ramdisk_size() = idx.ramdisk_size;
+    z_info.hdr_sz = idx.z_hdr_sz;
+    z_info.tail_sz = idx.z_tail_sz;
+    z_info.tail = ptr(idx.z_tail);
+    k_hdr = reinterpret_cast<const mtk_hdr *>(ptr(idx.k_hdr));
+    r_hdr = reinterpret_cast<const mtk_hdr *>(ptr(idx.r_hdr));
+    z_hdr = reinterpret_cast<const zimage_hdr *>(ptr(idx.z_hdr));
+    kernel_dtb = ptr(idx.kernel_dtb);
+    tail = ptr(idx.tail);
+    tail_size = idx.tail_size;
+    avb_footer = reinterpret_cast<const AvbFooter *>(ptr(idx.avb_footer));
+    vbmeta = reinterpret_cast<const AvbVBMetaImageHeader *>(ptr(idx.vbmeta));
+    kernel = ptr(idx.kernel);
+    ramdisk = ptr(idx.ramdisk);
+    second = ptr(idx.second);
+    extra = ptr(idx.extra);
+    recovery_dtbo = ptr(idx.recovery_dtbo);
+    dtb = ptr(idx.dtb);
+    ignore = ptr(idx.ignore);
+    ignore_size = idx.ignore_size;
+    return true;
+}
+
+int index_image(const char *image) {
+    boot_img boot(image);
+    if (!boot.save_index(image)) {
+        fprintf(stderr, "Cannot write index for [%s]\n", image);
+        return 1;
+    }
+    return 0;
+}
+
 int split_image_dtb(const char *filename) {
     auto img = mmap_data(filename);
 
@@ -475,6 +732,8 @@ int split_image_dtb(const char *filename) {
 
 int unpack(const char *image, bool skip_decomp, bool hdr) {
     boot_img boot(image);
+    int img_fd = xopen(image, O_RDONLY | O_CLOEXEC);
+    run_finally f([=]{ close(img_fd); });
 
     if (hdr)
         boot.hdr->dump_hdr_file();
@@ -487,11 +746,11 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
             close(fd);
         }
     } else {
-        dump(boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
+        dump(img_fd, boot.map, boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
     }
 
     // Dump kernel_dtb
-    dump(boot.kernel_dtb, boot.hdr->kernel_dt_size, KER_DTB_FILE);
+    dump(img_fd, boot.map, boot.kernel_dtb, boot.hdr->kernel_dt_size, KER_DTB_FILE);
 
     // Dump ramdisk
     if (!skip_decomp && COMPRESSED(boot.r_fmt)) {
@@ -501,11 +760,11 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
             close(fd);
         }
     } else {
-        dump(boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
+        dump(img_fd, boot.map, boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
     }
 
     // Dump second
-    dump(boot.second, boot.hdr->second_size(), SECOND_FILE);
+    dump(img_fd, boot.map, boot.second, boot.hdr->second_size(), SECOND_FILE);
 
     // Dump extra
     if (!skip_decomp && COMPRESSED(boot.e_fmt)) {
@@ -515,20 +774,20 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
             close(fd);
         }
     } else {
-        dump(boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
+        dump(img_fd, boot.map, boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
     }
 
     // Dump recovery_dtbo
-    dump(boot.recovery_dtbo, boot.hdr->recovery_dtbo_size(), RECV_DTBO_FILE);
+    dump(img_fd, boot.map, boot.recovery_dtbo, boot.hdr->recovery_dtbo_size(), RECV_DTBO_FILE);
 
     // Dump dtb
-    dump(boot.dtb, boot.hdr->dtb_size(), DTB_FILE);
+    dump(img_fd, boot.map, boot.dtb, boot.hdr->dtb_size(), DTB_FILE);
 
     return boot.flags[CHROMEOS_FLAG] ? 2 : 0;
 }
 
 #define file_align_with(page_size) \
-write_zero(fd, align_padding(lseek(fd, 0, SEEK_CUR) - off.header, page_size))
+img.pos += align_padding(img.pos - off.header, page_size)
 
 #define file_align() file_align_with(boot.hdr->page_size())
 
@@ -558,84 +817,82 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     if (access(HEADER_FILE, R_OK) == 0)
         hdr->load_hdr_file();
 
-    /***************
-     * Write blocks
-     ***************/
+    /****************
+     * Layout blocks
+     ****************/
 
-    // Create new image
-    int fd = creat(out_img, 0644);
+    img_layout img;
 
     if (boot.flags[DHTB_FLAG]) {
         // Skip DHTB header
-        write_zero(fd, sizeof(dhtb_hdr));
+        img.pos += sizeof(dhtb_hdr);
     } else if (boot.flags[BLOB_FLAG]) {
-        xwrite(fd, boot.map.buf, sizeof(blob_hdr));
+        img.add(boot.map.buf, sizeof(blob_hdr));
     } else if (boot.flags[NOOKHD_FLAG]) {
-        xwrite(fd, boot.map.buf, NOOKHD_PRE_HEADER_SZ);
+        img.add(boot.map.buf, NOOKHD_PRE_HEADER_SZ);
     } else if (boot.flags[ACCLAIM_FLAG]) {
-        xwrite(fd, boot.map.buf, ACCLAIM_PRE_HEADER_SZ);
+        img.add(boot.map.buf, ACCLAIM_PRE_HEADER_SZ);
     }
 
     // Copy raw header
-    off.header = lseek(fd, 0, SEEK_CUR);
-    xwrite(fd, boot.hdr_addr, hdr->hdr_space());
+    off.header = img.pos;
+    img.add(boot.hdr_addr, hdr->hdr_space());
 
     // kernel
-    off.kernel = lseek(fd, 0, SEEK_CUR);
+    off.kernel = img.pos;
     if (boot.flags[MTK_KERNEL]) {
         // Copy MTK headers
-        xwrite(fd, boot.k_hdr, sizeof(mtk_hdr));
+        img.add(boot.k_hdr, sizeof(mtk_hdr));
     }
     if (boot.flags[ZIMAGE_KERNEL]) {
         // Copy zImage headers
-        xwrite(fd, boot.z_hdr, boot.z_info.hdr_sz);
+        img.add(boot.z_hdr, boot.z_info.hdr_sz);
     }
     if (access(KERNEL_FILE, R_OK) == 0) {
         auto m = mmap_data(KERNEL_FILE);
         if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(boot.k_fmt)) {
             // Always use zopfli for zImage compression
             auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == GZIP) ? ZOPFLI : boot.k_fmt;
-            hdr->kernel_size() = compress(fmt, fd, m.buf, m.sz);
+            hdr->kernel_size() = img.add(compress(fmt, m.buf, m.sz));
         } else {
-            hdr->kernel_size() = xwrite(fd, m.buf, m.sz);
+            hdr->kernel_size() = img.add_file(KERNEL_FILE);
         }
 
         if (boot.flags[ZIMAGE_KERNEL]) {
             if (hdr->kernel_size() > boot.hdr->kernel_size()) {
                 fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
-                ftruncate64(fd, lseek64(fd, - (off64_t) hdr->kernel_size(), SEEK_CUR));
-                xwrite(fd, boot.kernel, boot.hdr->kernel_size());
+                img.truncate(img.pos - hdr->kernel_size());
+                img.add(boot.kernel, boot.hdr->kernel_size());
             } else if (!skip_comp) {
                 // Pad zeros to make sure the zImage file size does not change
                 // Also ensure the last 4 bytes are the uncompressed vmlinux size
                 uint32_t sz = m.sz;
-                write_zero(fd, boot.hdr->kernel_size() - hdr->kernel_size() - sizeof(sz));
-                xwrite(fd, &sz, sizeof(sz));
+                img.pos += boot.hdr->kernel_size() - hdr->kernel_size() - sizeof(sz);
+                img.copy(&sz, sizeof(sz));
             }
 
             // zImage size shall remain the same
             hdr->kernel_size() = boot.hdr->kernel_size();
         }
     } else if (boot.hdr->kernel_size() != 0) {
-        xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-        hdr->kernel_size() = boot.hdr->kernel_size();
+        hdr->kernel_size() = img.add(boot.kernel, boot.hdr->kernel_size());
     }
     if (boot.flags[ZIMAGE_KERNEL]) {
         // Copy zImage tail and adjust size accordingly
         hdr->kernel_size() += boot.z_info.hdr_sz;
-        hdr->kernel_size() += xwrite(fd, boot.z_info.tail, boot.z_info.tail_sz);
+        hdr->kernel_size() += img.add(boot.z_info.tail, boot.z_info.tail_sz);
     }
 
     // kernel dtb
     if (access(KER_DTB_FILE, R_OK) == 0)
-        hdr->kernel_size() += restore(fd, KER_DTB_FILE);
+        hdr->kernel_size() += img.add_file(KER_DTB_FILE);
     file_align();
 
     // ramdisk
-    off.ramdisk = lseek(fd, 0, SEEK_CUR);
+    off.ramdisk = img.pos;
     if (boot.flags[MTK_RAMDISK]) {
         // Copy MTK headers
-        xwrite(fd, boot.r_hdr, sizeof(mtk_hdr));
+        img.add(boot.r_hdr, sizeof(mtk_hdr));
     }
     if (access(RAMDISK_FILE, R_OK) == 0) {
         auto m = mmap_data(RAMDISK_FILE);
@@ -648,63 +905,63 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
             r_fmt = LZ4_LEGACY;
         }
         if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(r_fmt)) {
-            hdr->ramdisk_size() = compress(r_fmt, fd, m.buf, m.sz);
+            hdr->ramdisk_size() = img.add(compress(r_fmt, m.buf, m.sz));
         } else {
-            hdr->ramdisk_size() = xwrite(fd, m.buf, m.sz);
+            hdr->ramdisk_size() = img.add_file(RAMDISK_FILE);
         }
         file_align();
     }
 
     // second
-    off.second = lseek(fd, 0, SEEK_CUR);
+    off.second = img.pos;
     if (access(SECOND_FILE, R_OK) == 0) {
-        hdr->second_size() = restore(fd, SECOND_FILE);
+        hdr->second_size() = img.add_file(SECOND_FILE);
         file_align();
     }
 
     // extra
-    off.extra = lseek(fd, 0, SEEK_CUR);
+    off.extra = img.pos;
     if (access(EXTRA_FILE, R_OK) == 0) {
         auto m = mmap_data(EXTRA_FILE);
         if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf, m.sz)) && COMPRESSED(boot.e_fmt)) {
-            hdr->extra_size() = compress(boot.e_fmt, fd, m.buf, m.sz);
+            hdr->extra_size() = img.add(compress(boot.e_fmt, m.buf, m.sz));
         } else {
-            hdr->extra_size() = xwrite(fd, m.buf, m.sz);
+            hdr->extra_size() = img.add_file(EXTRA_FILE);
         }
         file_align();
     }
 
     // recovery_dtbo
     if (access(RECV_DTBO_FILE, R_OK) == 0) {
-        hdr->recovery_dtbo_offset() = lseek(fd, 0, SEEK_CUR);
-        hdr->recovery_dtbo_size() = restore(fd, RECV_DTBO_FILE);
+        hdr->recovery_dtbo_offset() = img.pos;
+        hdr->recovery_dtbo_size() = img.add_file(RECV_DTBO_FILE);
         file_align();
     }
 
     // dtb
-    off.dtb = lseek(fd, 0, SEEK_CUR);
+    off.dtb = img.pos;
     if (access(DTB_FILE, R_OK) == 0) {
-        hdr->dtb_size() = restore(fd, DTB_FILE);
+        hdr->dtb_size() = img.add_file(DTB_FILE);
         file_align();
     }
 
     // Directly copy ignored blobs
     if (boot.ignore_size) {
         // ignore_size should already be aligned
-        xwrite(fd, boot.ignore, boot.ignore_size);
+        img.add(boot.ignore, boot.ignore_size);
     }
 
     // Proprietary stuffs
     if (boot.flags[SEANDROID_FLAG]) {
-        xwrite(fd, SEANDROID_MAGIC, 16);
+        img.add(SEANDROID_MAGIC, 16);
         if (boot.flags[DHTB_FLAG]) {
-            xwrite(fd, "\xFF\xFF\xFF\xFF", 4);
+            img.add("\xFF\xFF\xFF\xFF", 4);
         }
     } else if (boot.flags[LG_BUMP_FLAG]) {
-        xwrite(fd, LG_BUMP_MAGIC, 16);
+        img.add(LG_BUMP_MAGIC, 16);
     }
 
-    off.total = lseek(fd, 0, SEEK_CUR);
+    off.total = img.pos;
     file_align();
 
     // vbmeta
@@ -712,27 +969,17 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         // According to avbtool.py, if the input is not an Android sparse image
         // (which boot images are not), the default block size is 4096
         file_align_with(4096);
-        off.vbmeta = lseek(fd, 0, SEEK_CUR);
+        off.vbmeta = img.pos;
         uint64_t vbmeta_size = __builtin_bswap64(boot.avb_footer->vbmeta_size);
-        xwrite(fd, boot.vbmeta, vbmeta_size);
+        img.add(boot.vbmeta, vbmeta_size);
     }
 
-    // Pad image to original size if not chromeos (as it requires post processing)
-    if (!boot.flags[CHROMEOS_FLAG]) {
-        off_t current = lseek(fd, 0, SEEK_CUR);
-        if (current < boot.map.sz) {
-            write_zero(fd, boot.map.sz - current);
-        }
-    }
+    /***********************
+     * Write and patch image
+     ***********************/
 
-    close(fd);
-
-    /******************
-     * Patch the image
-     ******************/
-
-    // Map output image as rw
-    auto out = mmap_data(out_img, true);
+    // Pad image to original size if not chromeos (as it requires post processing)
+    auto out = img.commit(out_img, boot.flags[CHROMEOS_FLAG] ? 0 : boot.map.sz);
 
     // MTK headers
     if (boot.flags[MTK_KERNEL]) {
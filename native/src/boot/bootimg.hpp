@@ -562,12 +562,72 @@ enum {
     BOOT_FLAGS_MAX
 };
 
+/*****************
+ * Boot Image Index
+ *****************/
+
+#define BOOT_INDEX_MAGIC    "MBIX"
+#define BOOT_INDEX_VERSION  2
+#define BOOT_INDEX_SUFFIX   ".idx"
+#define BOOT_INDEX_NONE     UINT64_MAX
+
+// Compact, serializable result of parsing a boot image.
+// All offsets are relative to the start of the image, BOOT_INDEX_NONE means absent.
+struct boot_index {
+    char magic[4];              /* "MBIX" */
+    uint32_t version;           /* BOOT_INDEX_VERSION */
+
+    // Identity of the indexed image
+    uint64_t img_size;
+    int64_t img_mtime_sec;
+    int64_t img_mtime_nsec;
+    uint32_t hdr_hash_size;     /* Bytes from img to the end of the header page */
+    uint8_t hdr_hash[20];       /* SHA1 of those bytes */
+
+    uint64_t flags;             /* boot_img::flags */
+    uint32_t img_type;          /* AOSP or AOSP_VENDOR */
+    uint32_t k_fmt;
+    uint32_t r_fmt;
+    uint32_t e_fmt;
+
+    // Section sizes adjusted while parsing
+    uint32_t kernel_size;
+    uint32_t kernel_dt_size;
+    uint32_t ramdisk_size;
+    uint32_t z_hdr_sz;
+    uint32_t z_tail_sz;
+    uint32_t second_size;
+    uint32_t extra_size;
+    uint32_t recovery_dtbo_size;
+    uint32_t dtb_size;
+    uint32_t padding;
+
+    uint64_t img;               /* Start of AOSP image, before any pre-header shift */
+    uint64_t k_hdr;
+    uint64_t r_hdr;
+    uint64_t z_hdr;
+    uint64_t z_tail;
+    uint64_t kernel_dtb;
+    uint64_t tail;
+    uint64_t tail_size;
+    uint64_t avb_footer;
+    uint64_t vbmeta;
+    uint64_t kernel;
+    uint64_t ramdisk;
+    uint64_t second;
+    uint64_t extra;
+    uint64_t recovery_dtbo;
+    uint64_t dtb;
+    uint64_t ignore;
+    uint64_t ignore_size;
+} __attribute__((packed));
+
 struct boot_img {
     // Memory map of the whole image
     mmap_data map;
 
     // Android image header
-    dyn_img_hdr *hdr;
+    dyn_img_hdr *hdr = nullptr;
 
     // Flags to indicate the state of current boot image
     std::bitset<BOOT_FLAGS_MAX> flags;
@@ -582,8 +642,8 @@ struct boot_img {
      *************************************************************/
 
     // MTK headers
-    const mtk_hdr *k_hdr;
-    const mtk_hdr *r_hdr;
+    const mtk_hdr *k_hdr = nullptr;
+    const mtk_hdr *r_hdr = nullptr;
 
     // The pointers/values after parse_image
     // +---------------+
@@ -593,35 +653,35 @@ struct boot_img {
     // +---------------+
     // | z_info.tail   | z_info.tail_sz
     // +---------------+
-    const zimage_hdr *z_hdr;
+    const zimage_hdr *z_hdr = nullptr;
     struct {
-        uint32_t hdr_sz;
+        uint32_t hdr_sz = 0;
         uint32_t tail_sz = 0;
         const uint8_t *tail = nullptr;
     } z_info;
 
     // Pointer to dtb that is embedded in kernel
-    const uint8_t *kernel_dtb;
+    const uint8_t *kernel_dtb = nullptr;
 
     // Pointer to end of image
-    const uint8_t *tail;
+    const uint8_t *tail = nullptr;
     size_t tail_size = 0;
 
     // AVB structs
-    const AvbFooter *avb_footer;
-    const AvbVBMetaImageHeader *vbmeta;
+    const AvbFooter *avb_footer = nullptr;
+    const AvbVBMetaImageHeader *vbmeta = nullptr;
 
     // Pointers to blocks defined in header
-    const uint8_t *hdr_addr;
-    const uint8_t *kernel;
-    const uint8_t *ramdisk;
-    const uint8_t *second;
-    const uint8_t *extra;
-    const uint8_t *recovery_dtbo;
-    const uint8_t *dtb;
+    const uint8_t *hdr_addr = nullptr;
+    const uint8_t *kernel = nullptr;
+    const uint8_t *ramdisk = nullptr;
+    const uint8_t *second = nullptr;
+    const uint8_t *extra = nullptr;
+    const uint8_t *recovery_dtbo = nullptr;
+    const uint8_t *dtb = nullptr;
 
     // Pointer to blocks defined in header, but we do not care
-    const uint8_t *ignore;
+    const uint8_t *ignore = nullptr;
     size_t ignore_size = 0;
 
     boot_img(const char *);
@@ -629,4 +689,12 @@ struct boot_img {
 
     void parse_image(const uint8_t *addr, format_t type);
     dyn_img_hdr *create_hdr(const uint8_t *addr, format_t type);
+
+    // Index cache stored next to the image
+    bool load_index(const char *image);
+    bool save_index(const char *image) const;
+private:
+    // Start of the AOSP image within the map
+    const uint8_t *img_addr = nullptr;
+    format_t img_type = UNKNOWN;
 };
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <algorithm>
+#include <vector>
 
 #include <base.hpp>
 
@@ -98,9 +99,79 @@ static void extract_entry(const cpio::entry_map::value_type &e, const char *file
     }
 }
 
+// Remove whatever occupies name in dirfd, regardless of its type
+static void clear_at(int dirfd, const char *name) {
+    if (unlinkat(dirfd, name, 0) < 0)
+        unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+struct extract_job {
+    int dirfd;
+    const char *name;
+    const cpio_entry *entry;
+};
+
 void cpio::extract() {
-    for (auto &e : entries)
-        extract_entry(e, e.first.data());
+    // Entries are sorted by path, so a directory is always visited before its children.
+    // Cache an fd for every directory so all further operations are relative to it.
+    map<string, int, StringCmp> dirs;
+    dirs.emplace("", xopen(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+
+    auto parent_fd = [&](string_view path) -> int {
+        auto it = dirs.find(path);
+        if (it != dirs.end())
+            return it->second;
+        // Parent was not an entry in the archive, create it once
+        string dir(path);
+        xmkdirs(dir.data(), 0755);
+        int fd = xopen(dir.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        dirs.emplace(std::move(dir), fd);
+        return fd;
+    };
+
+    // Pass 1: create the directory skeleton and symlinks, collect regular files
+    vector<extract_job> jobs;
+    for (auto &[path, e] : entries) {
+        fprintf(stderr, "Extract [%s] to [%s]\n", path.data(), path.data());
+        auto slash = path.rfind('/');
+        string_view parent = slash == string::npos ? ""sv : string_view(path).substr(0, slash);
+        const char *name = path.data() + (slash == string::npos ? 0 : slash + 1);
+        int dirfd = parent_fd(parent);
+        if (S_ISDIR(e->mode)) {
+            struct stat st;
+            if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(st.st_mode))
+                clear_at(dirfd, name);
+            if (mkdirat(dirfd, name, e->mode & 0777) < 0 && errno != EEXIST)
+                PLOGE("mkdirat %s", path.data());
+            int fd = xopenat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd >= 0)
+                dirs.emplace(path, fd);
+        } else if (S_ISREG(e->mode)) {
+            clear_at(dirfd, name);
+            jobs.push_back({ dirfd, name, e.get() });
+        } else if (S_ISLNK(e->mode) && e->filesize < 4096) {
+            clear_at(dirfd, name);
+            char target[4096];
+            memcpy(target, e->data, e->filesize);
+            target[e->filesize] = '\0';
+            symlinkat(target, dirfd, name);
+        }
+    }
+
+    // Pass 2: write out regular files on a worker pool
+    parallel_for(jobs.size(), [&](size_t i) {
+        auto &job = jobs[i];
+        int fd = xopenat(job.dirfd, job.name,
+                         O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, job.entry->mode & 0777);
+        if (fd < 0)
+            return;
+        xwrite(fd, job.entry->data, job.entry->filesize);
+        fchown(fd, job.entry->uid, job.entry->gid);
+        close(fd);
+    }, 16);
+
+    for (auto &[_, fd] : dirs)
+        close(fd);
 }
 
 bool cpio::extract(const char *name, const char *file) {
@@ -93,17 +93,25 @@ static int find_fstab(const void *fdt, int node = 0) {
     return -1;
 }
 
-template<typename Func>
-static void for_each_fdt(const char *file, bool rw, Func fn) {
-    auto m = mmap_data(file, rw);
-    uint8_t *end = m.buf + m.sz;
-    for (uint8_t *fdt = m.buf; fdt < end;) {
+// Locate every FDT in the buffer once
+static vector<uint8_t *> index_fdt(uint8_t *buf, size_t sz) {
+    vector<uint8_t *> list;
+    uint8_t * const end = buf + sz;
+    for (uint8_t *fdt = buf; fdt < end;) {
         fdt = static_cast<uint8_t*>(memmem(fdt, end - fdt, DTB_MAGIC, sizeof(fdt32_t)));
         if (fdt == nullptr)
             break;
-        fn(fdt);
+        list.push_back(fdt);
         fdt += fdt_totalsize(fdt);
     }
+    return list;
+}
+
+template<typename Func>
+static void for_each_fdt(const char *file, bool rw, Func fn) {
+    auto m = mmap_data(file, rw);
+    for (uint8_t *fdt : index_fdt(m.buf, m.sz))
+        fn(fdt);
 }
 
 static void dtb_print(const char *file, bool fstab) {
@@ -124,37 +132,57 @@ static void dtb_print(const char *file, bool fstab) {
     fprintf(stderr, "\n");
 }
 
+// Places to patch in a single FDT
+struct fdt_patch_sites {
+    void *skip_initramfs = nullptr;
+    vector<pair<void *, int>> fsmgr_flags;
+};
+
 static bool dtb_patch(const char *file) {
     fprintf(stderr, "Loading dtbs from [%s]\n", file);
 
     bool keep_verity = check_env("KEEPVERITY");
-    bool patched = false;
-    for_each_fdt(file, true, [&](uint8_t *fdt) {
+    auto m = mmap_data(file, true);
+    auto fdt_list = index_fdt(m.buf, m.sz);
+
+    // Walking the trees is the expensive part, every FDT is searched independently
+    vector<fdt_patch_sites> sites(fdt_list.size());
+    parallel_for(fdt_list.size(), [&](size_t i) {
+        uint8_t *fdt = fdt_list[i];
         int node;
-        // Patch the chosen node for bootargs
+        // Find bootargs in the chosen node
         fdt_for_each_subnode(node, fdt, 0) {
             if (auto name = fdt_get_name(fdt, node, nullptr); !name || name != "chosen"sv)
                 continue;
             int len;
-            if (auto value = fdt_getprop(fdt, node, "bootargs", &len)) {
-                if (void *skip = memmem(value, len, "skip_initramfs", 14)) {
-                    fprintf(stderr, "Patch [skip_initramfs] -> [want_initramfs]\n");
-                    memcpy(skip, "want", 4);
-                    patched = true;
-                }
-            }
+            if (auto value = fdt_getprop(fdt, node, "bootargs", &len))
+                sites[i].skip_initramfs = memmem(value, len, "skip_initramfs", 14);
             break;
         }
         if (!keep_verity) {
             if (int fstab = find_fstab(fdt); fstab >= 0) {
                 fdt_for_each_subnode(node, fdt, fstab) {
                     int len;
-                    char *value = (char *) fdt_getprop(fdt, node, "fsmgr_flags", &len);
-                    patched |= patch_verity(value, len) != len;
+                    if (auto value = (char *) fdt_getprop(fdt, node, "fsmgr_flags", &len))
+                        sites[i].fsmgr_flags.emplace_back(value, len);
                 }
             }
         }
     });
+
+    // Patch on this thread so the log stays in order
+    bool patched = false;
+    for (auto &site : sites) {
+        if (site.skip_initramfs) {
+            fprintf(stderr, "Patch [skip_initramfs] -> [want_initramfs]\n");
+            memcpy(site.skip_initramfs, "want", 4);
+            patched = true;
+        }
+        for (auto [value, len] : site.fsmgr_flags) {
+            if (patch_verity(value, len) != len)
+                patched = true;
+        }
+    }
     return patched;
 }
 
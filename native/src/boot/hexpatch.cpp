@@ -1,4 +1,5 @@
 #include <sys/mman.h>
+#include <algorithm>
 
 #include <base.hpp>
 
@@ -6,36 +7,167 @@
 
 using namespace std;
 
-static void hex2byte(const char *hex, uint8_t *buf) {
-    char high, low;
-    for (int i = 0, length = strlen(hex); i < length; i += 2) {
-        high = toupper(hex[i]) - '0';
-        low = toupper(hex[i + 1]) - '0';
-        buf[i / 2] = ((high > 9 ? high - 7 : high) << 4) + (low > 9 ? low - 7 : low);
+// A hex pattern with '?' wildcard nibbles.
+// For search patterns a wildcard matches anything; for replacements it keeps the original nibble.
+struct hex_pattern {
+    vector<uint8_t> data;
+    vector<uint8_t> mask;
+
+    bool parse(string_view hex);
+    bool match(const uint8_t *p) const {
+        for (size_t i = 0; i < data.size(); ++i) {
+            if ((p[i] & mask[i]) != data[i])
+                return false;
+        }
+        return true;
     }
+};
+
+static int hex2nibble(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = toupper(c);
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
 }
 
-int hexpatch(const char *file, const char *from, const char *to) {
-    int patched = 1;
+bool hex_pattern::parse(string_view hex) {
+    if (hex.length() % 2)
+        return false;
+    data.resize(hex.length() / 2);
+    mask.resize(hex.length() / 2);
+    for (size_t i = 0; i < hex.length(); ++i) {
+        int shift = i % 2 ? 0 : 4;
+        if (hex[i] == '?')
+            continue;
+        int v = hex2nibble(hex[i]);
+        if (v < 0)
+            return false;
+        data[i / 2] |= v << shift;
+        mask[i / 2] |= 0xF << shift;
+    }
+    return true;
+}
+
+struct hex_patch {
+    string from_str;
+    string to_str;
+    hex_pattern from;
+    hex_pattern to;
+    // The longest run of fully specified bytes in from, used as the automaton key
+    size_t anchor_off = 0;
+    size_t anchor_len = 0;
+    int hits = 0;
+
+    bool parse();
+};
+
+bool hex_patch::parse() {
+    if (!from.parse(from_str) || !to.parse(to_str) || from.data.empty()) {
+        fprintf(stderr, "Invalid hex pattern [%s] -> [%s]\n", from_str.data(), to_str.data());
+        return false;
+    }
+    for (size_t i = 0; i < from.mask.size();) {
+        size_t j = i;
+        while (j < from.mask.size() && from.mask[j] == 0xFF)
+            ++j;
+        if (j - i > anchor_len) {
+            anchor_off = i;
+            anchor_len = j - i;
+        }
+        i = j + 1;
+    }
+    if (anchor_len == 0) {
+        fprintf(stderr, "Pattern [%s] has no fixed byte\n", from_str.data());
+        return false;
+    }
+    return true;
+}
+
+static int hexpatch(const char *file, vector<hex_patch> &patches) {
+    for (auto &p : patches) {
+        if (!p.parse())
+            return 1;
+    }
 
     auto m = mmap_data(file, true);
+    if (m.buf == nullptr)
+        return 1;
 
-    vector<uint8_t> pattern(strlen(from) / 2);
-    vector<uint8_t> patch(strlen(to) / 2);
+    vector<string_view> anchors;
+    for (auto &p : patches)
+        anchors.emplace_back(
+                reinterpret_cast<const char *>(p.from.data.data() + p.anchor_off), p.anchor_len);
 
-    hex2byte(from, pattern.data());
-    hex2byte(to, patch.data());
+    // Find every candidate in one pass, verify the masked pattern around its anchor
+    vector<pair<size_t, int>> matches;
+    byte_matcher(anchors).scan(m.buf, m.sz, [&](int idx, size_t off) -> bool {
+        auto &p = patches[idx];
+        if (off < p.anchor_off)
+            return true;
+        size_t start = off - p.anchor_off;
+        if (start + p.from.data.size() <= m.sz && p.from.match(m.buf + start))
+            matches.emplace_back(start, idx);
+        return true;
+    });
 
-    uint8_t * const end = m.buf + m.sz;
-    for (uint8_t *curr = m.buf; curr < end; curr += pattern.size()) {
-        curr = static_cast<uint8_t*>(memmem(curr, end - curr, pattern.data(), pattern.size()));
-        if (curr == nullptr)
-            return patched;
-        fprintf(stderr, "Patch @ %08X [%s] -> [%s]\n", (unsigned)(curr - m.buf), from, to);
-        memset(curr, 0, pattern.size());
-        memcpy(curr, patch.data(), patch.size());
-        patched = 0;
+    // Apply leftmost non-overlapping matches, earlier patches win on ties
+    sort(matches.begin(), matches.end());
+    size_t end = 0;
+    for (auto [off, idx] : matches) {
+        if (off < end)
+            continue;
+        auto &p = patches[idx];
+        fprintf(stderr, "Patch @ %08X [%s] -> [%s]\n",
+                (unsigned) off, p.from_str.data(), p.to_str.data());
+        uint8_t *curr = m.buf + off;
+        size_t len = std::max(p.from.data.size(), p.to.data.size());
+        len = std::min(len, m.sz - off);
+        for (size_t i = 0; i < len; ++i) {
+            uint8_t orig = curr[i];
+            if (i >= p.to.data.size()) {
+                curr[i] = 0;
+            } else {
+                curr[i] = (orig & ~p.to.mask[i]) | p.to.data[i];
+            }
+        }
+        ++p.hits;
+        end = off + p.from.data.size();
     }
 
+    int patched = 1;
+    for (auto &p : patches) {
+        if (patches.size() > 1)
+            fprintf(stderr, "Patched [%s] %d time(s)\n", p.from_str.data(), p.hits);
+        if (p.hits)
+            patched = 0;
+    }
     return patched;
 }
+
+int hexpatch(const char *file, int argc, char *argv[]) {
+    vector<hex_patch> patches;
+    for (int i = 0; i + 1 < argc; i += 2)
+        patches.push_back({ .from_str = argv[i], .to_str = argv[i + 1] });
+    return hexpatch(file, patches);
+}
+
+int hexpatch_list(const char *file, const char *list) {
+    vector<hex_patch> patches;
+    file_readline(true, list, [&](string_view line) -> bool {
+        if (line.empty() || line[0] == '#')
+            return true;
+        auto tokens = split(line, " \t");
+        tokens.erase(remove(tokens.begin(), tokens.end(), ""), tokens.end());
+        if (tokens.size() == 2) {
+            patches.push_back({ .from_str = tokens[0], .to_str = tokens[1] });
+        } else {
+            fprintf(stderr, "Invalid patch list entry [%.*s]\n", (int) line.size(), line.data());
+        }
+        return true;
+    });
+    if (patches.empty())
+        return 1;
+    return hexpatch(file, patches);
+}
@@ -16,8 +16,10 @@
 
 int unpack(const char *image, bool skip_decomp = false, bool hdr = false);
 void repack(const char *src_img, const char *out_img, bool skip_comp = false);
+int index_image(const char *image);
 int split_image_dtb(const char *filename);
-int hexpatch(const char *file, const char *from, const char *to);
+int hexpatch(const char *file, int argc, char *argv[]);
+int hexpatch_list(const char *file, const char *list);
 int cpio_commands(int argc, char *argv[]);
 int dtb_commands(int argc, char *argv[]);
 
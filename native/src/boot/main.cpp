@@ -45,6 +45,11 @@ Supported actions:
     If env variable PATCHVBMETAFLAG is set to true, all disable flags in
     the boot image's vbmeta header will be set.
 
+  index <bootimg>
+    Parse <bootimg> and save its structural index to '<bootimg>.idx'.
+    As long as <bootimg> is not modified, the index is used by unpack
+    and repack instead of scanning the image again.
+
   extract <payload.bin> [partition] [outfile]
     Extract [partition] from <payload.bin> to [outfile].
     If [outfile] is not specified, then output to '[partition].img'.
@@ -52,9 +57,18 @@ Supported actions:
     'init_boot' or 'boot'. Which partition was chosen can be determined
     by whichever 'init_boot.img' or 'boot.img' exists.
     <payload.bin> can be '-' to be STDIN.
+    <payload.bin> can also be a full OTA zip, in which case its stored
+    payload.bin entry is used in place without extracting it.
 
-  hexpatch <file> <hexpattern1> <hexpattern2>
+  hexpatch <file> <hexpattern1> <hexpattern2> [<hexpattern1> <hexpattern2>...]
+  hexpatch -f <file> <patchlist>
     Search <hexpattern1> in <file>, and replace it with <hexpattern2>
+    Multiple pattern pairs can be given, or read from <patchlist> with
+    one '<hexpattern1> <hexpattern2>' pair per line ('#' for comments).
+    All patterns are applied in a single pass over <file>.
+    '?' matches any nibble in <hexpattern1>, and keeps the original
+    nibble in <hexpattern2>.
+    Return 0 if any pattern was patched, else return 1
 
   cpio <incpio> [commands...]
     Do cpio commands to <incpio> (modifications are done in-place)
@@ -194,12 +208,18 @@ int main(int argc, char *argv[]) {
         } else {
             repack(argv[2], argv[3] ? argv[3] : NEW_BOOT);
         }
+    } else if (argc > 2 && action == "index") {
+        return index_image(argv[2]);
     } else if (argc > 2 && action == "decompress") {
         decompress(argv[2], argv[3]);
     } else if (argc > 2 && str_starts(action, "compress")) {
         compress(action[8] == '=' ? &action[9] : "gzip", argv[2], argv[3]);
     } else if (argc > 4 && action == "hexpatch") {
-        return hexpatch(argv[2], argv[3], argv[4]);
+        if (argv[2] == "-f"sv)
+            return hexpatch_list(argv[3], argv[4]);
+        if (argc % 2 == 0)
+            usage(argv[0]);
+        return hexpatch(argv[2], argc - 3, argv + 3);
     } else if (argc > 2 && action == "cpio"sv) {
         if (cpio_commands(argc - 2, argv + 2))
             usage(argv[0]);
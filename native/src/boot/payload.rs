@@ -1,18 +1,23 @@
+use std::cmp::min;
 use std::fs::File;
-use std::io::{BufReader, Read, Seek, SeekFrom, Write};
+use std::io::{BufReader, Cursor, Read, Seek, SeekFrom, Write};
 use std::os::fd::{AsRawFd, FromRawFd};
+use std::os::unix::fs::FileExt;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::{io, ptr, slice, thread};
 
 use anyhow::{anyhow, Context};
 use byteorder::{BigEndian, ReadBytesExt};
 use protobuf::{EnumFull, Message};
 
+use base::libc;
 use base::libc::c_char;
-use base::{ptr_to_str_result, ReadSeekExt, StrErr};
-use base::{ResultExt, WriteExt};
+use base::{ptr_to_str_result, ReadExt, StrErr};
+use base::{warn, ResultExt, WriteExt};
 
 use crate::ffi;
 use crate::update_metadata::install_operation::Type;
-use crate::update_metadata::DeltaArchiveManifest;
+use crate::update_metadata::{DeltaArchiveManifest, InstallOperation, PartitionUpdate};
 
 macro_rules! bad_payload {
     ($msg:literal) => {
@@ -25,17 +30,14 @@ macro_rules! bad_payload {
 
 const PAYLOAD_MAGIC: &str = "CrAU";
 
-fn do_extract_boot_from_payload(
-    in_path: &str,
-    partition_name: Option<&str>,
-    out_path: Option<&str>,
-) -> anyhow::Result<()> {
-    let mut reader = BufReader::new(if in_path == "-" {
-        unsafe { File::from_raw_fd(0) }
-    } else {
-        File::open(in_path).with_context(|| format!("cannot open '{in_path}'"))?
-    });
+struct PayloadHeader {
+    manifest: DeltaArchiveManifest,
+    manifest_sig_len: u32,
+    // Size of everything before the manifest signature
+    header_len: u64,
+}
 
+fn read_payload_header<R: Read>(reader: &mut R) -> anyhow::Result<PayloadHeader> {
     let buf = &mut [0u8; 4];
     reader.read_exact(buf)?;
 
@@ -72,8 +74,17 @@ fn do_extract_boot_from_payload(
         ));
     }
 
-    let block_size = manifest.block_size() as u64;
+    Ok(PayloadHeader {
+        manifest,
+        manifest_sig_len,
+        header_len: 4 + 8 + 8 + 4 + manifest_len as u64,
+    })
+}
 
+fn find_partition<'a>(
+    manifest: &'a DeltaArchiveManifest,
+    partition_name: Option<&str>,
+) -> anyhow::Result<&'a PartitionUpdate> {
     let partition = match partition_name {
         None => {
             let boot = manifest
@@ -95,6 +106,306 @@ fn do_extract_boot_from_payload(
             .find(|p| p.partition_name() == name)
             .ok_or(anyhow!("partition '{name}' not found"))?,
     };
+    Ok(partition)
+}
+
+struct OperationInfo {
+    data_type: Type,
+    data_offset: u64,
+    data_len: usize,
+    out_offset: u64,
+}
+
+fn operation_info(operation: &InstallOperation, block_size: u64) -> anyhow::Result<OperationInfo> {
+    let data_len = operation
+        .data_length
+        .ok_or(bad_payload!("data length not found"))? as usize;
+
+    let data_offset = operation
+        .data_offset
+        .ok_or(bad_payload!("data offset not found"))?;
+
+    let data_type = operation
+        .type_
+        .ok_or(bad_payload!("operation type not found"))?
+        .enum_value()
+        .map_err(|_| bad_payload!("operation type not valid"))?;
+
+    let out_offset = operation
+        .dst_extents
+        .get(0)
+        .ok_or(bad_payload!("dst extents not found"))?
+        .start_block
+        .ok_or(bad_payload!("start block not found"))?
+        * block_size;
+
+    match data_type {
+        Type::REPLACE | Type::ZERO | Type::REPLACE_BZ | Type::REPLACE_XZ => {}
+        _ => {
+            return Err(bad_payload!(
+                "unsupported operation type: {}",
+                data_type.descriptor().name()
+            ));
+        }
+    }
+
+    Ok(OperationInfo {
+        data_type,
+        data_offset,
+        data_len,
+        out_offset,
+    })
+}
+
+fn zero_extents<F: FnMut(u64, u64) -> anyhow::Result<()>>(
+    operation: &InstallOperation,
+    block_size: u64,
+    mut f: F,
+) -> anyhow::Result<()> {
+    for ext in operation.dst_extents.iter() {
+        let out_seek = ext
+            .start_block
+            .ok_or(bad_payload!("start block not found"))?
+            * block_size;
+        let num_blocks = ext.num_blocks.ok_or(bad_payload!("num blocks not found"))?;
+        f(out_seek, num_blocks * block_size)?;
+    }
+    Ok(())
+}
+
+fn write_zeros_at(file: &File, mut offset: u64, mut len: u64) -> io::Result<()> {
+    let buf = [0_u8; 4096];
+    while len > 0 {
+        let l = min(buf.len() as u64, len) as usize;
+        file.write_all_at(&buf[..l], offset)?;
+        offset += l as u64;
+        len -= l as u64;
+    }
+    Ok(())
+}
+
+// Read-only mapping of the whole payload file
+struct MappedFile {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+impl MappedFile {
+    fn open(file: &File) -> io::Result<MappedFile> {
+        // Does not fit into the address space of 32-bit processes
+        let len = usize::try_from(file.metadata()?.len())
+            .map_err(|_| io::Error::from(io::ErrorKind::OutOfMemory))?;
+        if len == 0 {
+            return Err(io::Error::from(io::ErrorKind::UnexpectedEof));
+        }
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(MappedFile { ptr, len })
+    }
+
+    fn as_slice(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.ptr as *const u8, self.len) }
+    }
+}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.ptr, self.len);
+        }
+    }
+}
+
+const ZIP_LOCAL_MAGIC: &[u8] = b"PK\x03\x04";
+const ZIP_EOCD_MAGIC: u32 = 0x06054b50;
+const ZIP64_EOCD_LOCATOR_MAGIC: u32 = 0x07064b50;
+const ZIP64_EOCD_MAGIC: u32 = 0x06064b50;
+const ZIP_CDIR_MAGIC: u32 = 0x02014b50;
+const ZIP_LOCAL_MAGIC_U32: u32 = 0x04034b50;
+const ZIP64_EXTRA_ID: u16 = 0x0001;
+const PAYLOAD_ENTRY: &str = "payload.bin";
+
+macro_rules! bad_zip {
+    ($msg:literal) => {
+        anyhow!(concat!("invalid zip: ", $msg))
+    };
+}
+
+// Random access to a zip file, either mapped or read through the file
+trait ZipSource {
+    fn size(&self) -> u64;
+    fn read_at(&self, off: u64, buf: &mut [u8]) -> anyhow::Result<()>;
+}
+
+impl ZipSource for [u8] {
+    fn size(&self) -> u64 {
+        self.len() as u64
+    }
+
+    fn read_at(&self, off: u64, buf: &mut [u8]) -> anyhow::Result<()> {
+        let src = usize::try_from(off)
+            .ok()
+            .and_then(|off| self.get(off..off.checked_add(buf.len())?))
+            .ok_or(bad_zip!("unexpected end of file"))?;
+        buf.copy_from_slice(src);
+        Ok(())
+    }
+}
+
+impl ZipSource for File {
+    fn size(&self) -> u64 {
+        self.metadata().map(|m| m.len()).unwrap_or(0)
+    }
+
+    fn read_at(&self, off: u64, buf: &mut [u8]) -> anyhow::Result<()> {
+        self.read_exact_at(buf, off)
+            .map_err(|_| bad_zip!("unexpected end of file"))
+    }
+}
+
+fn read_le<const N: usize>(src: &(impl ZipSource + ?Sized), off: u64) -> anyhow::Result<[u8; N]> {
+    let mut buf = [0u8; N];
+    src.read_at(off, &mut buf)?;
+    Ok(buf)
+}
+
+fn le16(src: &(impl ZipSource + ?Sized), off: u64) -> anyhow::Result<u16> {
+    Ok(u16::from_le_bytes(read_le(src, off)?))
+}
+
+fn le32(src: &(impl ZipSource + ?Sized), off: u64) -> anyhow::Result<u32> {
+    Ok(u32::from_le_bytes(read_le(src, off)?))
+}
+
+fn le64(src: &(impl ZipSource + ?Sized), off: u64) -> anyhow::Result<u64> {
+    Ok(u64::from_le_bytes(read_le(src, off)?))
+}
+
+fn add(a: u64, b: u64) -> anyhow::Result<u64> {
+    a.checked_add(b).ok_or(bad_zip!("offset overflow"))
+}
+
+// Locate a stored (uncompressed) entry in a zip file through its central directory,
+// the same way read_certificate finds the signing block of an APK:
+// scan from the end of file to find the EOCD record (or its zip64 variant),
+// then walk the central directory and finally skip the entry's local header.
+// Only the pages holding these records are touched.
+// Returns the offset and size of the entry data.
+fn find_zip_entry(src: &(impl ZipSource + ?Sized), name: &str) -> anyhow::Result<(u64, u64)> {
+    const EOCD_SZ: u64 = 22;
+    let size = src.size();
+
+    // Find EOCD within the last EOCD_SZ + max comment size bytes, i is the size of the comment
+    let tail_len = min(size, EOCD_SZ + 0xffff);
+    let mut tail = vec![0u8; tail_len as usize];
+    src.read_at(size - tail_len, &mut tail)?;
+    let tail = tail.as_slice();
+    let mut eocd = None;
+    for i in 0..=0xffff_u64 {
+        if tail_len < EOCD_SZ + i {
+            break;
+        }
+        let off = tail_len - EOCD_SZ - i;
+        if le16(tail, off + 20)? as u64 == i && le32(tail, off)? == ZIP_EOCD_MAGIC {
+            eocd = Some(size - tail_len + off);
+            break;
+        }
+    }
+    let eocd = eocd.ok_or(bad_zip!("end of central directory not found"))?;
+
+    let mut num_entries = le16(src, eocd + 10)? as u64;
+    let mut cdir_off = le32(src, eocd + 16)? as u64;
+
+    // Zip64 EOCD locator is placed right before EOCD
+    if eocd >= 20 && le32(src, eocd - 20)? == ZIP64_EOCD_LOCATOR_MAGIC {
+        let eocd64 = le64(src, eocd - 20 + 8)?;
+        if le32(src, eocd64)? != ZIP64_EOCD_MAGIC {
+            return Err(bad_zip!("invalid zip64 end of central directory"));
+        }
+        num_entries = le64(src, add(eocd64, 32)?)?;
+        cdir_off = le64(src, add(eocd64, 48)?)?;
+    }
+
+    let mut off = cdir_off;
+    for _ in 0..num_entries {
+        if le32(src, off)? != ZIP_CDIR_MAGIC {
+            return Err(bad_zip!("invalid central directory"));
+        }
+        let method = le16(src, add(off, 10)?)?;
+        let mut comp_size = le32(src, add(off, 20)?)? as u64;
+        let mut uncomp_size = le32(src, add(off, 24)?)? as u64;
+        let name_len = le16(src, add(off, 28)?)? as u64;
+        let extra_len = le16(src, add(off, 30)?)? as u64;
+        let comment_len = le16(src, add(off, 32)?)? as u64;
+        let mut local_off = le32(src, add(off, 42)?)? as u64;
+
+        let mut entry_name = vec![0u8; name_len as usize];
+        src.read_at(add(off, 46)?, &mut entry_name)?;
+        if entry_name == name.as_bytes() {
+            // Zip64 extended information only contains fields that overflowed
+            let extra = add(off, 46 + name_len)?;
+            let extra_end = add(extra, extra_len)?;
+            let mut pos = extra;
+            while pos + 4 <= extra_end {
+                let id = le16(src, pos)?;
+                let len = le16(src, pos + 2)? as u64;
+                if id == ZIP64_EXTRA_ID {
+                    let mut field = pos + 4;
+                    for v in [&mut uncomp_size, &mut comp_size, &mut local_off] {
+                        if *v == u32::MAX as u64 {
+                            *v = le64(src, field)?;
+                            field += 8;
+                        }
+                    }
+                }
+                pos += 4 + len;
+            }
+
+            if method != 0 || comp_size != uncomp_size {
+                return Err(anyhow!(
+                    "'{name}' is compressed in zip, please extract it first"
+                ));
+            }
+
+            if le32(src, local_off)? != ZIP_LOCAL_MAGIC_U32 {
+                return Err(bad_zip!("invalid local file header"));
+            }
+            let header_len =
+                30 + le16(src, add(local_off, 26)?)? as u64 + le16(src, add(local_off, 28)?)? as u64;
+            let start = add(local_off, header_len)?;
+            if add(start, comp_size)? > size {
+                return Err(bad_zip!("unexpected end of file"));
+            }
+            return Ok((start, comp_size));
+        }
+        off = add(off, 46 + name_len + extra_len + comment_len)?;
+    }
+
+    Err(anyhow!("'{name}' not found in zip"))
+}
+
+// Used for stdin and inputs that cannot be mapped:
+// the install operations are processed strictly in order of data_offset
+fn extract_streaming(
+    mut reader: impl Read,
+    partition_name: Option<&str>,
+    out_path: Option<&str>,
+) -> anyhow::Result<()> {
+    let header = read_payload_header(&mut reader)?;
+    let manifest = &header.manifest;
+    let block_size = manifest.block_size() as u64;
+    let partition = find_partition(manifest, partition_name)?;
 
     let out_str: String;
     let out_path = match out_path {
@@ -109,80 +420,191 @@ fn do_extract_boot_from_payload(
         File::create(out_path).with_context(|| format!("cannot write to '{out_path}'"))?;
 
     // Skip the manifest signature
-    reader.skip(manifest_sig_len as usize)?;
+    ReadExt::skip(&mut reader, header.manifest_sig_len as usize)?;
 
     // Sort the install operations with data_offset so we will only ever need to seek forward
     // This makes it possible to support non-seekable input file descriptors
     let mut operations = partition.operations.clone();
     operations.sort_by_key(|e| e.data_offset.unwrap_or(0));
     let mut curr_data_offset: u64 = 0;
+    let mut buf = Vec::new();
 
     for operation in operations.iter() {
-        let data_len = operation
-            .data_length
-            .ok_or(bad_payload!("data length not found"))? as usize;
-
-        let data_offset = operation
-            .data_offset
-            .ok_or(bad_payload!("data offset not found"))?;
-
-        let data_type = operation
-            .type_
-            .ok_or(bad_payload!("operation type not found"))?
-            .enum_value()
-            .map_err(|_| bad_payload!("operation type not valid"))?;
+        let info = operation_info(operation, block_size)?;
 
-        buf.resize(data_len, 0u8);
-        let data = &mut buf[..data_len];
+        buf.resize(info.data_len, 0u8);
+        let data = &mut buf[..info.data_len];
 
         // Skip to the next offset and read data
-        let skip = data_offset - curr_data_offset;
-        reader.skip(skip as usize)?;
+        let skip = info
+            .data_offset
+            .checked_sub(curr_data_offset)
+            .ok_or(bad_payload!("operation data overlaps"))?;
+        ReadExt::skip(&mut reader, skip as usize)?;
         reader.read_exact(data)?;
-        curr_data_offset = data_offset + data_len as u64;
-
-        let out_offset = operation
-            .dst_extents
-            .get(0)
-            .ok_or(bad_payload!("dst extents not found"))?
-            .start_block
-            .ok_or(bad_payload!("start block not found"))?
-            * block_size;
+        curr_data_offset = info
+            .data_offset
+            .checked_add(info.data_len as u64)
+            .ok_or(bad_payload!("operation data out of bounds"))?;
 
-        match data_type {
+        match info.data_type {
             Type::REPLACE => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
+                out_file.seek(SeekFrom::Start(info.out_offset))?;
                 out_file.write_all(&data)?;
             }
             Type::ZERO => {
-                for ext in operation.dst_extents.iter() {
-                    let out_seek = ext
-                        .start_block
-                        .ok_or(bad_payload!("start block not found"))?
-                        * block_size;
-                    let num_blocks = ext.num_blocks.ok_or(bad_payload!("num blocks not found"))?;
-                    out_file.seek(SeekFrom::Start(out_seek))?;
-                    out_file.write_zeros(num_blocks as usize)?;
-                }
+                zero_extents(operation, block_size, |offset, len| {
+                    out_file.seek(SeekFrom::Start(offset))?;
+                    out_file.write_zeros(len as usize)?;
+                    Ok(())
+                })?;
             }
-            Type::REPLACE_BZ | Type::REPLACE_XZ => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
+            _ => {
+                out_file.seek(SeekFrom::Start(info.out_offset))?;
                 if !ffi::decompress(data, out_file.as_raw_fd()) {
                     return Err(bad_payload!("decompression failed"));
                 }
             }
-            _ => {
-                return Err(bad_payload!(
-                    "unsupported operation type: {}",
-                    data_type.descriptor().name()
-                ));
-            }
         };
     }
 
     Ok(())
 }
 
+// Seekable input: map the payload and run the install operations on a worker pool.
+// Every worker owns a separate file description of the output, so seeks do not race.
+fn extract_parallel(
+    payload: &[u8],
+    partition_name: Option<&str>,
+    out_path: Option<&str>,
+) -> anyhow::Result<()> {
+    let header = read_payload_header(&mut Cursor::new(payload))?;
+    let manifest = &header.manifest;
+    let block_size = manifest.block_size() as u64;
+    let partition = find_partition(manifest, partition_name)?;
+
+    let out_str: String;
+    let out_path = match out_path {
+        None => {
+            out_str = format!("{}.img", partition.partition_name());
+            out_str.as_str()
+        }
+        Some(s) => s,
+    };
+
+    File::create(out_path).with_context(|| format!("cannot write to '{out_path}'"))?;
+
+    // Validate all operations before starting any work
+    let data_start = header.header_len + header.manifest_sig_len as u64;
+    let operations = &partition.operations;
+    let mut infos = Vec::with_capacity(operations.len());
+    for operation in operations.iter() {
+        let info = operation_info(operation, block_size)?;
+        let end = data_start
+            .checked_add(info.data_offset)
+            .and_then(|start| start.checked_add(info.data_len as u64));
+        if end.map_or(true, |end| end > payload.len() as u64) {
+            return Err(bad_payload!("operation data out of bounds"));
+        }
+        infos.push(info);
+    }
+
+    let next = AtomicUsize::new(0);
+    let num_threads = thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1)
+        .min(infos.len())
+        .max(1);
+
+    let worker = || -> anyhow::Result<()> {
+        let mut out_file = File::options()
+            .write(true)
+            .open(out_path)
+            .with_context(|| format!("cannot write to '{out_path}'"))?;
+        loop {
+            let i = next.fetch_add(1, Ordering::Relaxed);
+            if i >= infos.len() {
+                break;
+            }
+            let info = &infos[i];
+            let start = (data_start + info.data_offset) as usize;
+            let data = &payload[start..start + info.data_len];
+            match info.data_type {
+                Type::REPLACE => {
+                    out_file.write_all_at(data, info.out_offset)?;
+                }
+                Type::ZERO => {
+                    zero_extents(&operations[i], block_size, |offset, len| {
+                        write_zeros_at(&out_file, offset, len)?;
+                        Ok(())
+                    })?;
+                }
+                _ => {
+                    out_file.seek(SeekFrom::Start(info.out_offset))?;
+                    if !ffi::decompress(data, out_file.as_raw_fd()) {
+                        return Err(bad_payload!("decompression failed"));
+                    }
+                }
+            }
+        }
+        Ok(())
+    };
+
+    thread::scope(|s| {
+        let handles: Vec<_> = (1..num_threads).map(|_| s.spawn(&worker)).collect();
+        let mut result = worker();
+        for h in handles {
+            let r = h
+                .join()
+                .unwrap_or_else(|_| Err(anyhow!("worker thread panicked")));
+            result = result.and(r);
+        }
+        result
+    })
+}
+
+fn do_extract_boot_from_payload(
+    in_path: &str,
+    partition_name: Option<&str>,
+    out_path: Option<&str>,
+) -> anyhow::Result<()> {
+    if in_path == "-" {
+        let reader = BufReader::new(unsafe { File::from_raw_fd(0) });
+        return extract_streaming(reader, partition_name, out_path);
+    }
+    let file = File::open(in_path).with_context(|| format!("cannot open '{in_path}'"))?;
+    if !file.metadata()?.is_file() {
+        return extract_streaming(BufReader::new(file), partition_name, out_path);
+    }
+    let map = match MappedFile::open(&file) {
+        Ok(map) => map,
+        Err(e) => {
+            // Usually a payload too large for a 32-bit address space
+            warn!("Cannot map '{in_path}' ({e}), extracting sequentially");
+            let mut magic = [0u8; 4];
+            file.read_exact_at(&mut magic, 0)?;
+            if magic.starts_with(ZIP_LOCAL_MAGIC) {
+                let (start, len) = find_zip_entry(&file, PAYLOAD_ENTRY)?;
+                let mut file = file;
+                file.seek(SeekFrom::Start(start))?;
+                let reader = BufReader::new(file.take(len));
+                return extract_streaming(reader, partition_name, out_path);
+            }
+            return extract_streaming(BufReader::new(file), partition_name, out_path);
+        }
+    };
+    let data = map.as_slice();
+    let payload = if data.starts_with(ZIP_LOCAL_MAGIC) {
+        // OTA zip, work on the stored payload.bin entry in place.
+        // The entry is within the mapping, so its bounds fit into usize.
+        let (start, len) = find_zip_entry(data, PAYLOAD_ENTRY)?;
+        &data[start as usize..(start + len) as usize]
+    } else {
+        data
+    };
+    extract_parallel(payload, partition_name, out_path)
+}
+
 pub fn extract_boot_from_payload(
     in_path: *const c_char,
     partition: *const c_char,
@@ -59,6 +59,7 @@ static void mount_mirrors() {
     }
 
     // Check and mount preinit mirror
+    auto staged = MAGISKTMP + "/" SEPOLCACHE;
     if (struct stat st{}; stat((MAGISKTMP + "/" PREINITDEV).data(), &st) == 0 && (st.st_mode & S_IFBLK)) {
         // DO NOT mount the block device directly, as we do not know the flags and configs
         // to properly mount the partition; mounting block devices directly as rw could cause
@@ -86,8 +87,25 @@ static void mount_mirrors() {
         if (!mounted) {
             LOGW("preinit mirror not mounted %u:%u\n", major(preinit_dev), minor(preinit_dev));
             unlink((MAGISKTMP + "/" PREINITDEV).data());
+        } else if (access(staged.data(), F_OK) == 0) {
+            // Persist the sepolicy magiskinit patched during this boot
+            auto cache = MAGISKTMP + "/" PREINITCACHE;
+            auto tmp = cache + ".tmp";
+            int src = xopen(staged.data(), O_RDONLY | O_CLOEXEC);
+            int dest = xopen(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (src >= 0 && dest >= 0) {
+                struct stat st{};
+                fstat(src, &st);
+                if (copy_range(dest, 0, src, 0, st.st_size) == st.st_size)
+                    rename(tmp.data(), cache.data());
+            }
+            close(src);
+            close(dest);
+            unlink(tmp.data());
         }
     }
+    // Nothing reads the staged policy after this point, do not keep it in memory
+    unlink(staged.data());
 
     // Prepare worker
     auto worker_dir = MAGISKTMP + "/" WORKERDIR;
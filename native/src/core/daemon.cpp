@@ -2,6 +2,7 @@
 #include <libgen.h>
 #include <sys/un.h>
 #include <sys/mount.h>
+#include <sys/epoll.h>
 
 #include <magisk.hpp>
 #include <base.hpp>
@@ -21,114 +22,115 @@ bool RECOVERY_MODE = false;
 
 static struct stat self_st;
 
-static map<int, poll_callback> *poll_map;
-static vector<pollfd> *poll_fds;
-static int poll_ctrl;
-
-enum {
-    POLL_CTRL_NEW,
-    POLL_CTRL_RM,
+// Registered callbacks, indexed by fd and guarded by poll_lock.
+// epoll_ctl is thread safe, so any thread can register or unregister directly.
+struct poll_entry {
+    short events;
+    poll_callback callback;
 };
+static vector<poll_entry> *poll_table;
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static int poll_epfd = -1;
+
+// The fd whose callback is running on the main thread. If another thread unregisters
+// it meanwhile, closing is deferred until the callback returns so the number cannot
+// be reused under the callback.
+static int poll_dispatch_fd = -1;
+static bool poll_close_pending;
 
 void register_poll(const pollfd *pfd, poll_callback callback) {
-    if (gettid() == getpid()) {
-        // On main thread, directly modify
-        poll_map->try_emplace(pfd->fd, callback);
-        poll_fds->emplace_back(*pfd);
-    } else {
-        // Send it to poll_ctrl
-        write_int(poll_ctrl, POLL_CTRL_NEW);
-        xwrite(poll_ctrl, pfd, sizeof(*pfd));
-        xwrite(poll_ctrl, &callback, sizeof(callback));
+    mutex_guard g(poll_lock);
+    if (pfd->fd >= poll_table->size())
+        poll_table->resize(pfd->fd + 1);
+    auto &entry = (*poll_table)[pfd->fd];
+    epoll_event ev{};
+    ev.events = pfd->events;
+    ev.data.fd = pfd->fd;
+    // An fd closed without unregister_poll drops out of epoll but leaves a stale
+    // entry behind, so a reused fd number has to be added again regardless
+    if (epoll_ctl(poll_epfd, EPOLL_CTL_ADD, pfd->fd, &ev) < 0) {
+        if (errno != EEXIST) {
+            PLOGE("epoll_ctl add %d", pfd->fd);
+            return;
+        }
+        if (entry.callback) {
+            LOGW("fd %d is already registered\n", pfd->fd);
+            return;
+        }
+        if (epoll_ctl(poll_epfd, EPOLL_CTL_MOD, pfd->fd, &ev) < 0) {
+            PLOGE("epoll_ctl mod %d", pfd->fd);
+            return;
+        }
+    } else if (entry.callback) {
+        LOGD("fd %d was closed without unregistering\n", pfd->fd);
     }
+    entry = { pfd->events, callback };
 }
 
 void unregister_poll(int fd, bool auto_close) {
     if (fd < 0)
         return;
 
-    if (gettid() == getpid()) {
-        // On main thread, directly modify
-        poll_map->erase(fd);
-        for (auto &poll_fd : *poll_fds) {
-            if (poll_fd.fd == fd) {
-                if (auto_close) {
-                    close(poll_fd.fd);
-                }
-                // Cannot modify while iterating, invalidate it instead
-                // It will be removed in the next poll loop
-                poll_fd.fd = -1;
-                break;
-            }
-        }
-    } else {
-        // Send it to poll_ctrl
-        write_int(poll_ctrl, POLL_CTRL_RM);
-        write_int(poll_ctrl, fd);
-        write_int(poll_ctrl, auto_close);
+    mutex_guard g(poll_lock);
+    if (fd >= poll_table->size() || !(*poll_table)[fd].callback)
+        return;
+    epoll_ctl(poll_epfd, EPOLL_CTL_DEL, fd, nullptr);
+    (*poll_table)[fd] = {};
+    if (auto_close) {
+        if (fd == poll_dispatch_fd && gettid() != getpid())
+            poll_close_pending = true;
+        else
+            close(fd);
     }
 }
 
 void clear_poll() {
-    if (poll_fds) {
-        for (auto &poll_fd : *poll_fds) {
-            close(poll_fd.fd);
+    // Only called in a freshly forked child, other threads are already gone
+    if (poll_table) {
+        for (int fd = 0; fd < poll_table->size(); ++fd) {
+            if ((*poll_table)[fd].callback)
+                close(fd);
         }
+        close(poll_epfd);
     }
-    delete poll_fds;
-    delete poll_map;
-    poll_fds = nullptr;
-    poll_map = nullptr;
-}
-
-static void poll_ctrl_handler(pollfd *pfd) {
-    int code = read_int(pfd->fd);
-    switch (code) {
-    case POLL_CTRL_NEW: {
-        pollfd new_fd{};
-        poll_callback cb;
-        xxread(pfd->fd, &new_fd, sizeof(new_fd));
-        xxread(pfd->fd, &cb, sizeof(cb));
-        register_poll(&new_fd, cb);
-        break;
-    }
-    case POLL_CTRL_RM: {
-        int fd = read_int(pfd->fd);
-        bool auto_close = read_int(pfd->fd);
-        unregister_poll(fd, auto_close);
-        break;
-    }
-    default:
-        __builtin_unreachable();
-    }
+    delete poll_table;
+    poll_table = nullptr;
+    poll_epfd = -1;
+    poll_dispatch_fd = -1;
+    poll_close_pending = false;
+    pthread_mutex_init(&poll_lock, nullptr);
 }
 
 [[noreturn]] static void poll_loop() {
-    // Register poll_ctrl
-    auto pipefd = array<int, 2>{-1, -1};
-    xpipe2(pipefd, O_CLOEXEC);
-    poll_ctrl = pipefd[1];
-    pollfd poll_ctrl_pfd = { pipefd[0], POLLIN, 0 };
-    register_poll(&poll_ctrl_pfd, poll_ctrl_handler);
-
+    epoll_event events[16];
     for (;;) {
-        if (poll(poll_fds->data(), poll_fds->size(), -1) <= 0)
-            continue;
-
-        // MUST iterate with index because any poll_callback could add new elements to poll_fds
-        for (int i = 0; i < poll_fds->size();) {
-            auto &pfd = (*poll_fds)[i];
-            if (pfd.revents) {
-                if (pfd.revents & POLLERR || pfd.revents & POLLNVAL) {
-                    poll_map->erase(pfd.fd);
-                    poll_fds->erase(poll_fds->begin() + i);
-                    continue;
-                }
-                if (auto it = poll_map->find(pfd.fd); it != poll_map->end()) {
-                    it->second(&pfd);
-                }
+        int n = epoll_wait(poll_epfd, events, std::size(events), -1);
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            poll_entry entry{};
+            {
+                mutex_guard g(poll_lock);
+                if (fd < poll_table->size())
+                    entry = (*poll_table)[fd];
+                if (entry.callback && !(events[i].events & EPOLLERR))
+                    poll_dispatch_fd = fd;
+            }
+            // Could have been unregistered by an earlier callback
+            if (!entry.callback)
+                continue;
+            if (events[i].events & EPOLLERR) {
+                unregister_poll(fd, false);
+                continue;
+            }
+            pollfd pfd = { fd, entry.events, static_cast<short>(events[i].events) };
+            entry.callback(&pfd);
+
+            mutex_guard g(poll_lock);
+            poll_dispatch_fd = -1;
+            if (poll_close_pending) {
+                close(fd);
+                poll_close_pending = false;
             }
-            ++i;
         }
     }
 }
@@ -162,6 +164,9 @@ static void handle_request_async(int client, int code, const sock_cred &cred) {
     case MainRequest::ZYGISK_PASSTHROUGH:
         zygisk_handler(client, &cred);
         break;
+    case MainRequest::STATS:
+        stats_handler(client);
+        break;
     default:
         __builtin_unreachable();
     }
@@ -200,8 +205,41 @@ static bool is_client(pid_t pid) {
     return !(stat(path, &st) || st.st_dev != self_st.st_dev || st.st_ino != self_st.st_ino);
 }
 
+// Zygote blocks on zygisk requests while an app is being spawned. Module companions,
+// scripts and management commands must not be able to starve them.
+// zygisk_handler moves all but the process info lookup to a lower class.
+static int request_class(int code) {
+    switch (code) {
+    case MainRequest::ZYGISK:
+        return TaskClass::CRITICAL;
+    case MainRequest::ZYGISK_PASSTHROUGH:
+    case MainRequest::SQLITE_CMD:
+    case MainRequest::DENYLIST:
+    case MainRequest::REMOVE_MODULES:
+    case MainRequest::STATS:
+        return TaskClass::BULK;
+    default:
+        return TaskClass::NORMAL;
+    }
+}
+
+// These handlers keep the connection for a whole session (a root shell, a zygote
+// connection), so only the time until the handler starts is a request latency
+static bool is_session_request(int code) {
+    switch (code) {
+    case MainRequest::SUPERUSER:
+    case MainRequest::ZYGISK:
+    case MainRequest::ZYGISK_PASSTHROUGH:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static void handle_request(pollfd *pfd) {
     int client = xaccept4(pfd->fd, nullptr, nullptr, SOCK_CLOEXEC);
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     // Verify client credentials
     sock_cred cred;
@@ -239,6 +277,7 @@ static void handle_request(pollfd *pfd) {
     case MainRequest::SQLITE_CMD:
     case MainRequest::DENYLIST:
     case MainRequest::STOP_DAEMON:
+    case MainRequest::STATS:
         if (!is_root) {
             write_int(client, MainResponse::ROOT_REQUIRED);
             goto done;
@@ -264,12 +303,21 @@ static void handle_request(pollfd *pfd) {
     write_int(client, MainResponse::OK);
 
     if (code < MainRequest::_SYNC_BARRIER_) {
+        stat_timer t(code, start);
         handle_request_sync(client, code);
         goto done;
     } else if (code < MainRequest::_STAGE_BARRIER_) {
-        exec_task([=] { handle_request_async(client, code, cred); });
+        exec_task([=] {
+            stat_timer t(code, start);
+            if (is_session_request(code))
+                t.finish();
+            handle_request_async(client, code, cred);
+        }, request_class(code));
     } else {
-        exec_task([=] { boot_stage_handler(client, code); });
+        exec_task([=] {
+            stat_timer t(code, start);
+            boot_stage_handler(client, code);
+        });
     }
     return;
 
@@ -399,8 +447,11 @@ static void daemon_entry() {
     setfilecon(addr.sun_path, MAGISK_FILE_CON);
     xlisten(fd, 10);
 
-    default_new(poll_map);
-    default_new(poll_fds);
+    default_new(poll_table);
+    if ((poll_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        PLOGE("epoll_create1");
+        exit(1);
+    }
     default_new(module_list);
 
     // Register handler for main socket
@@ -4,6 +4,7 @@
 
 #include <magisk.hpp>
 #include <db.hpp>
+#include <daemon.hpp>
 #include <socket.hpp>
 #include <base.hpp>
 
@@ -280,6 +281,7 @@ static char *open_and_init_db(sqlite3 *&db) {
 }
 
 char *db_exec(const char *sql) {
+    stat_timer t(DaemonStat::DB_EXEC);
     char *err = nullptr;
     if (mDB == nullptr) {
         err = open_and_init_db(mDB);
@@ -306,6 +308,7 @@ static int sqlite_db_row_callback(void *cb, int col_num, char **data, char **col
 }
 
 char *db_exec(const char *sql, const db_row_cb &fn) {
+    stat_timer t(DaemonStat::DB_EXEC);
     char *err = nullptr;
     if (mDB == nullptr) {
         err = open_and_init_db(mDB);
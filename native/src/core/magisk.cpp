@@ -39,6 +39,8 @@ Advanced Options (Internal APIs):
    --path                    print Magisk tmpfs mount path
    --denylist ARGS           denylist config CLI
    --preinit-device          resolve a device to store preinit files
+   --stats [--reset]         print daemon latency metrics, reset them
+                             afterwards with --reset
 
 Available applets:
 )EOF");
@@ -104,6 +106,11 @@ int magisk_main(int argc, char *argv[]) {
     } else if (argv[1] == "--zygote-restart"sv) {
         close(connect_daemon(MainRequest::ZYGOTE_RESTART));
         return 0;
+    } else if (argv[1] == "--stats"sv) {
+        int fd = connect_daemon(MainRequest::STATS);
+        write_int(fd, argc >= 3 && argv[2] == "--reset"sv);
+        printf("%s", read_string(fd).data());
+        return 0;
     } else if (argv[1] == "--denylist"sv) {
         return denylist_cli(argc - 1, argv + 1);
     } else if (argc >= 3 && argv[1] == "--sqlite"sv) {
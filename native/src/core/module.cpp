@@ -457,15 +457,21 @@ static int check_rules_dir(char *buf, size_t sz) {
     return off;
 }
 
+// Remove the rules of a module, and their compiled form, from the preinit directory
+static void unlink_rules(char *buf, size_t sz, int off, const char *module) {
+    ssprintf(buf + off, sz - off, "/%s/sepolicy.rule", module);
+    unlink(buf);
+    ssprintf(buf + off, sz - off, "/%s/sepolicy.rule.bin", module);
+    unlink(buf);
+}
+
 void disable_modules() {
     char buf[4096];
     int off = check_rules_dir(buf, sizeof(buf));
     foreach_module([&](int, dirent *entry, int modfd) {
         close(xopenat(modfd, "disable", O_RDONLY | O_CREAT | O_CLOEXEC, 0));
-        if (off) {
-            ssprintf(buf + off, sizeof(buf) - off, "/%s/sepolicy.rule", entry->d_name);
-            unlink(buf);
-        }
+        if (off)
+            unlink_rules(buf, sizeof(buf), off, entry->d_name);
     });
 }
 
@@ -476,10 +482,8 @@ void remove_modules() {
         auto uninstaller = MODULEROOT + "/"s + entry->d_name + "/uninstall.sh";
         if (access(uninstaller.data(), F_OK) == 0)
             exec_script(uninstaller.data());
-        if (off) {
-            ssprintf(buf + off, sizeof(buf) - off, "/%s/sepolicy.rule", entry->d_name);
-            unlink(buf);
-        }
+        if (off)
+            unlink_rules(buf, sizeof(buf), off, entry->d_name);
     });
     rm_rf(MODULEROOT);
 }
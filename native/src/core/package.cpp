@@ -89,6 +89,7 @@ static void install_stub() {
 }
 
 int get_manager(int user_id, string *pkg, bool install) {
+    stat_timer t(DaemonStat::GET_MANAGER);
     mutex_guard g(pkg_lock);
 
     char app_path[128];
@@ -20,19 +20,19 @@ static const char *bbpath() {
     return path.data();
 }
 
-static void set_script_env() {
-    setenv("ASH_STANDALONE", "1", 1);
-    char new_path[4096];
-    sprintf(new_path, "%s:%s", getenv("PATH"), MAGISKTMP.data());
-    setenv("PATH", new_path, 1);
-    if (zygisk_enabled)
-        setenv("ZYGISK_ENABLED", "1", 1);
+// Environment variables of all scripts, passed to exec_t so they can be spawned
+struct script_env {
+    string path = "PATH="s + (getenv("PATH") ?: "") + ':' + MAGISKTMP;
+    const char *vars[4] = {
+        "ASH_STANDALONE=1", path.data(), zygisk_enabled ? "ZYGISK_ENABLED=1" : nullptr, nullptr
+    };
 };
 
 void exec_script(const char *script) {
+    script_env env;
     exec_t exec {
-        .pre_exec = set_script_env,
-        .fork = fork_no_orphan
+        .fork = fork_no_orphan,
+        .env = env.vars
     };
     exec_command_sync(exec, BBEXEC_CMD, script);
 }
@@ -92,6 +92,7 @@ void exec_common_scripts(const char *stage) {
 
     *(name++) = '/';
     int dfd = dirfd(dir.get());
+    script_env env;
     for (dirent *entry; (entry = xreaddir(dir.get()));) {
         if (entry->d_type == DT_REG) {
             if (faccessat(dfd, entry->d_name, X_OK, 0) != 0)
@@ -99,8 +100,8 @@ void exec_common_scripts(const char *stage) {
             LOGI("%s.d: exec [%s]\n", stage, entry->d_name);
             strcpy(name, entry->d_name);
             exec_t exec {
-                .pre_exec = set_script_env,
-                .fork = pfs ? xfork : fork_dont_care
+                .fork = pfs ? xfork : fork_dont_care,
+                .env = env.vars
             };
             exec_command(exec, BBEXEC_CMD, path);
             PFS_WAIT()
@@ -133,6 +134,7 @@ void exec_module_scripts(const char *stage, const vector<string_view> &modules)
     PFS_SETUP()
 
     char path[4096];
+    script_env env;
     for (auto &m : modules) {
         const char *module = m.data();
         sprintf(path, MODULEROOT "/%s/%s.sh", module, stage);
@@ -140,8 +142,8 @@ void exec_module_scripts(const char *stage, const vector<string_view> &modules)
             continue;
         LOGI("%s: exec [%s.sh]\n", module, stage);
         exec_t exec {
-            .pre_exec = set_script_env,
-            .fork = pfs ? xfork : fork_dont_care
+            .fork = pfs ? xfork : fork_dont_care,
+            .env = env.vars
         };
         exec_command(exec, BBEXEC_CMD, path);
         PFS_WAIT()
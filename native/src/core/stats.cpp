@@ -0,0 +1,122 @@
+// Lock-free latency metrics of the daemon
+
+#include <atomic>
+
+#include <base.hpp>
+#include <daemon.hpp>
+
+using namespace std;
+
+// Latencies are bucketed by powers of two in microseconds,
+// the last bucket also takes everything slower than that
+#define STAT_BUCKETS 25
+
+struct latency_stat {
+    atomic<uint64_t> count;
+    atomic<uint64_t> total_us;
+    atomic<uint64_t> max_us;
+    atomic<uint64_t> buckets[STAT_BUCKETS];
+};
+
+static latency_stat stats[DaemonStat::END];
+
+static const char *stat_name(int id) {
+    switch (id) {
+    case MainRequest::START_DAEMON: return "start_daemon";
+    case MainRequest::CHECK_VERSION: return "check_version";
+    case MainRequest::CHECK_VERSION_CODE: return "check_version_code";
+    case MainRequest::STOP_DAEMON: return "stop_daemon";
+    case MainRequest::SUPERUSER: return "superuser";
+    case MainRequest::ZYGOTE_RESTART: return "zygote_restart";
+    case MainRequest::DENYLIST: return "denylist";
+    case MainRequest::SQLITE_CMD: return "sqlite_cmd";
+    case MainRequest::REMOVE_MODULES: return "remove_modules";
+    case MainRequest::ZYGISK: return "zygisk";
+    case MainRequest::ZYGISK_PASSTHROUGH: return "zygisk_passthrough";
+    case MainRequest::STATS: return "stats";
+    case MainRequest::POST_FS_DATA: return "post_fs_data";
+    case MainRequest::LATE_START: return "late_start";
+    case MainRequest::BOOT_COMPLETE: return "boot_complete";
+    case DaemonStat::DB_EXEC: return "db_exec";
+    case DaemonStat::GET_MANAGER: return "get_manager";
+    case DaemonStat::SU_INFO: return "su_info";
+    case DaemonStat::ZYGISK_INFO: return "zygisk_info";
+    default: return nullptr;
+    }
+}
+
+void record_stat(int id, uint64_t us) {
+    if (id < 0 || id >= DaemonStat::END)
+        return;
+    auto &s = stats[id];
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    s.buckets[std::min(bucket, STAT_BUCKETS - 1)].fetch_add(1, memory_order_relaxed);
+    s.count.fetch_add(1, memory_order_relaxed);
+    s.total_us.fetch_add(us, memory_order_relaxed);
+    uint64_t max = s.max_us.load(memory_order_relaxed);
+    while (us > max && !s.max_us.compare_exchange_weak(max, us, memory_order_relaxed));
+}
+
+// Upper bound of the bucket where the given fraction of samples is reached
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, double p) {
+    uint64_t target = count * p;
+    uint64_t seen = 0;
+    for (int i = 0; i < STAT_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen > target)
+            return i ? UINT64_C(1) << i : 0;
+    }
+    return UINT64_C(1) << (STAT_BUCKETS - 1);
+}
+
+static string dump_stats() {
+    string out;
+    char buf[256];
+    ssprintf(buf, sizeof(buf), "%-20s %8s %10s %10s %10s %10s %10s\n",
+             "name", "count", "avg(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+    out += buf;
+    for (int id = 0; id < DaemonStat::END; ++id) {
+        const char *name = stat_name(id);
+        auto &s = stats[id];
+        uint64_t count = s.count.load(memory_order_relaxed);
+        if (name == nullptr || count == 0)
+            continue;
+        uint64_t buckets[STAT_BUCKETS];
+        for (int i = 0; i < STAT_BUCKETS; ++i)
+            buckets[i] = s.buckets[i].load(memory_order_relaxed);
+        ssprintf(buf, sizeof(buf), "%-20s %8llu %10llu %10llu %10llu %10llu %10llu\n", name,
+                 (unsigned long long) count,
+                 (unsigned long long) (s.total_us.load(memory_order_relaxed) / count),
+                 (unsigned long long) percentile(buckets, count, 0.5),
+                 (unsigned long long) percentile(buckets, count, 0.9),
+                 (unsigned long long) percentile(buckets, count, 0.99),
+                 (unsigned long long) s.max_us.load(memory_order_relaxed));
+        out += buf;
+    }
+    out += "\nRequests holding a session (superuser, zygisk) only count\n"
+           "the time until their handler starts.\n";
+    auto pool = get_pool_stats();
+    ssprintf(buf, sizeof(buf), "thread pool: %d threads, %zu idle, %zu queued, %zu max queued\n",
+             pool.total, pool.idle, pool.pending, pool.max_pending);
+    out += buf;
+    return out;
+}
+
+static void reset_stats() {
+    for (auto &s : stats) {
+        s.count.store(0, memory_order_relaxed);
+        s.total_us.store(0, memory_order_relaxed);
+        s.max_us.store(0, memory_order_relaxed);
+        for (auto &b : s.buckets)
+            b.store(0, memory_order_relaxed);
+    }
+    reset_pool_stats();
+}
+
+void stats_handler(int client) {
+    bool reset = read_int(client);
+    write_string(client, dump_stats());
+    if (reset)
+        reset_stats();
+    close(client);
+}
@@ -99,6 +99,9 @@ public:
     }
 };
 
+static const char *content_env[] = { "CLASSPATH=/system/framework/content.jar", nullptr };
+static const char *am_env[] = { "CLASSPATH=/system/framework/am.jar", nullptr };
+
 static bool check_no_error(int fd) {
     char buf[1024];
     auto out = xopen_file(fd, "r");
@@ -137,8 +140,8 @@ static void exec_cmd(const char *action, vector<Extra> &data,
         exec_t exec {
             .err = true,
             .fd = -1,
-            .pre_exec = [] { setenv("CLASSPATH", "/system/framework/content.jar", 1); },
-            .argv = args.data()
+            .argv = args.data(),
+            .env = content_env
         };
         exec_command_sync(exec);
         if (check_no_error(exec.fd))
@@ -154,9 +157,9 @@ static void exec_cmd(const char *action, vector<Extra> &data,
     args.push_back(nullptr);
     exec_t exec {
         .fd = -2,
-        .pre_exec = [] { setenv("CLASSPATH", "/system/framework/am.jar", 1); },
         .fork = fork_dont_care,
-        .argv = args.data()
+        .argv = args.data(),
+        .env = am_env
     };
     exec_command(exec);
 }
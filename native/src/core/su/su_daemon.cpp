@@ -166,6 +166,7 @@ void prune_su_access() {
 
 static shared_ptr<su_info> get_su_info(unsigned uid) {
     LOGD("su: request from uid=[%d]\n", uid);
+    stat_timer t(DaemonStat::SU_INFO);
 
     if (uid == AID_ROOT) {
         auto info = make_shared<su_info>(uid);
@@ -1,5 +1,8 @@
 // Cached thread pool implementation
 
+#include <deque>
+#include <climits>
+
 #include <base.hpp>
 
 #include <daemon.hpp>
@@ -8,15 +11,48 @@ using namespace std;
 
 #define THREAD_IDLE_MAX_SEC 60
 #define CORE_POOL_SIZE 3
+// Max number of bulk tasks running at once, the rest wait in the queue
+#define BULK_POOL_SIZE 2
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t send_task = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
-static pthread_cond_t recv_task = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
 
 // The following variables should be guarded by lock
-static int idle_threads = 0;
+static size_t idle_threads = 0;
 static int total_threads = 0;
-static function<void()> pending_task;
+static deque<function<void()>> pending_tasks[TaskClass::END];
+static int running_tasks[TaskClass::END];
+static size_t max_pending = 0;
+
+static int class_limit(int cls) {
+    return cls == TaskClass::BULK ? BULK_POOL_SIZE : INT_MAX;
+}
+
+// Number of queued tasks that are allowed to start right now
+static size_t runnable_tasks() {
+    size_t n = 0;
+    for (int cls = 0; cls < TaskClass::END; ++cls) {
+        size_t slots = class_limit(cls) - running_tasks[cls];
+        n += std::min(pending_tasks[cls].size(), slots);
+    }
+    return n;
+}
+
+// The most important class that has a task allowed to start, or -1
+static int next_class() {
+    for (int cls = 0; cls < TaskClass::END; ++cls) {
+        if (!pending_tasks[cls].empty() && running_tasks[cls] < class_limit(cls))
+            return cls;
+    }
+    return -1;
+}
+
+static size_t total_pending() {
+    size_t n = 0;
+    for (auto &q : pending_tasks)
+        n += q.size();
+    return n;
+}
 
 static void operator+=(timespec &a, const timespec &b) {
     a.tv_sec += b.tv_sec;
@@ -34,11 +70,13 @@ static void reset_pool() {
     pthread_mutex_init(&lock, nullptr);
     pthread_cond_destroy(&send_task);
     send_task = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
-    pthread_cond_destroy(&recv_task);
-    recv_task = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
     idle_threads = 0;
     total_threads = 0;
-    pending_task = nullptr;
+    for (int cls = 0; cls < TaskClass::END; ++cls) {
+        pending_tasks[cls].clear();
+        running_tasks[cls] = 0;
+    }
+    max_pending = 0;
 }
 
 static void *thread_pool_loop(void * const is_core_pool) {
@@ -52,17 +90,19 @@ static void *thread_pool_loop(void * const is_core_pool) {
         // Restore sigmask
         pthread_sigmask(SIG_SETMASK, &mask, nullptr);
         function<void()> local_task;
+        int cls;
         {
             mutex_guard g(lock);
             ++idle_threads;
-            if (!pending_task) {
+            while ((cls = next_class()) < 0) {
                 if (is_core_pool) {
                     pthread_cond_wait(&send_task, &lock);
                 } else {
                     timespec ts;
                     clock_gettime(CLOCK_MONOTONIC, &ts);
                     ts += { THREAD_IDLE_MAX_SEC, 0 };
-                    if (pthread_cond_timedwait(&send_task, &lock, &ts) == ETIMEDOUT) {
+                    if (pthread_cond_timedwait(&send_task, &lock, &ts) == ETIMEDOUT &&
+                        next_class() < 0) {
                         // Terminate thread after max idle time
                         --idle_threads;
                         --total_threads;
@@ -70,28 +110,47 @@ static void *thread_pool_loop(void * const is_core_pool) {
                     }
                 }
             }
-            if (pending_task) {
-                local_task.swap(pending_task);
-                pthread_cond_signal(&recv_task);
-            }
             --idle_threads;
+            ++running_tasks[cls];
+            local_task.swap(pending_tasks[cls].front());
+            pending_tasks[cls].pop_front();
         }
-        if (local_task)
-            local_task();
+        local_task();
         if (getpid() == gettid())
             exit(0);
+        {
+            // This thread goes straight back to the queue, so it picks up
+            // any task of the same class that was waiting for this slot
+            mutex_guard g(lock);
+            --running_tasks[cls];
+        }
     }
 }
 
-void exec_task(function<void()> &&task) {
+// Never blocks the caller. Every runnable task is guaranteed a thread that will check
+// the queue after it was added: either a signaled idle thread or a new one.
+// Tasks of a class at its concurrency limit are picked up by the thread that
+// finishes the running one. Idle threads always take the most important class first.
+// The pool is not capped, as tasks may block for as long as a su session lasts.
+void exec_task(function<void()> &&task, int cls) {
     mutex_guard g(lock);
-    pending_task.swap(task);
-    if (idle_threads == 0) {
+    pending_tasks[cls].push_back(std::move(task));
+    max_pending = std::max(max_pending, total_pending());
+    if (runnable_tasks() > idle_threads) {
         ++total_threads;
         long is_core_pool = total_threads <= CORE_POOL_SIZE;
         new_daemon_thread(thread_pool_loop, (void *) is_core_pool);
     } else {
         pthread_cond_signal(&send_task);
     }
-    pthread_cond_wait(&recv_task, &lock);
+}
+
+pool_stats get_pool_stats() {
+    mutex_guard g(lock);
+    return { total_threads, idle_threads, total_pending(), max_pending };
+}
+
+void reset_pool_stats() {
+    mutex_guard g(lock);
+    max_pending = total_pending();
 }
@@ -36,6 +36,7 @@ enum : int {
     REMOVE_MODULES,
     ZYGISK,
     ZYGISK_PASSTHROUGH,
+    STATS,
 
     _STAGE_BARRIER_,
 
@@ -81,13 +82,63 @@ void unregister_poll(int fd, bool auto_close);
 void clear_poll();
 
 // Thread pool
-void exec_task(std::function<void()> &&task);
+namespace TaskClass {
+enum : int {
+    CRITICAL,  // On the app launch path, always dequeued first
+    NORMAL,
+    BULK,      // Administrative and module traffic, limited concurrency
+    END
+};
+}
+void exec_task(std::function<void()> &&task, int cls = TaskClass::NORMAL);
+struct pool_stats {
+    int total;
+    size_t idle;
+    size_t pending;
+    size_t max_pending;
+};
+pool_stats get_pool_stats();
+void reset_pool_stats();
+
+// Latency metrics, ids below MainRequest::END are request codes
+namespace DaemonStat {
+enum : int {
+    DB_EXEC = MainRequest::END,
+    GET_MANAGER,
+    SU_INFO,
+    ZYGISK_INFO,
+    END
+};
+}
+void record_stat(int id, uint64_t us);
+
+// Record the time spent in a scope, or until finish() is called
+class stat_timer {
+public:
+    explicit stat_timer(int id) : id(id) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    stat_timer(int id, const timespec &start) : id(id), start(start) {}
+    ~stat_timer() { finish(); }
+    void finish() {
+        if (id < 0)
+            return;
+        timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        record_stat(id, (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000);
+        id = -1;
+    }
+private:
+    int id;
+    timespec start;
+};
 
 // Daemon handlers
 void boot_stage_handler(int client, int code);
 void denylist_handler(int client, const sock_cred *cred);
 void su_daemon_handler(int client, const sock_cred *cred);
 void zygisk_handler(int client, const sock_cred *cred);
+void stats_handler(int client);
 
 // Package
 void preserve_stub_apk();
@@ -25,6 +25,8 @@ extern std::string    MAGISKTMP;
 #define ROOTMNT       ROOTOVL  "/.mount_list"
 #define ZYGISKBIN     INTLROOT "/zygisk"
 #define SELINUXMOCK   INTLROOT "/selinux"
+#define SEPOLCACHE    INTLROOT "/sepolicy.cache"
+#define PREINITCACHE  PREINITMIRR "/.sepolicy.cache"
 #define MAIN_CONFIG   INTLROOT "/config"
 #define MAIN_SOCKET   INTLROOT "/socket"
 
@@ -4,6 +4,7 @@
 #include <vector>
 
 #include <xz.h>
+#include <lz4.h>
 
 #include <base.hpp>
 #include <embed.hpp>
@@ -12,37 +13,55 @@
 
 using namespace std;
 
+#define UNPACK_BUF_SZ (1 << 20)
+
 bool unxz(int fd, const uint8_t *buf, size_t size) {
-    uint8_t out[8192];
-    xz_crc32_init();
+    static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+    pthread_once(&crc_once, xz_crc32_init);
+    heap_data out(UNPACK_BUF_SZ);
     struct xz_dec *dec = xz_dec_init(XZ_DYNALLOC, 1 << 26);
+    run_finally f([=] { xz_dec_end(dec); });
     struct xz_buf b = {
         .in = buf,
         .in_pos = 0,
         .in_size = size,
-        .out = out,
+        .out = out.buf,
         .out_pos = 0,
-        .out_size = sizeof(out)
+        .out_size = out.sz
     };
     enum xz_ret ret;
     do {
         ret = xz_dec_run(dec, &b);
         if (ret != XZ_OK && ret != XZ_STREAM_END)
             return false;
-        write(fd, out, b.out_pos);
+        xwrite(fd, out.buf, b.out_pos);
         b.out_pos = 0;
     } while (b.in_pos != size);
     return true;
 }
 
-static int dump_bin(const uint8_t *buf, size_t sz, const char *path, mode_t mode) {
+// LZ4 block prefixed with its uncompressed size, see lz4() in build.py
+bool unlz4(int fd, const uint8_t *buf, size_t size) {
+    if (size < sizeof(uint32_t))
+        return false;
+    uint32_t out_sz;
+    memcpy(&out_sz, buf, sizeof(out_sz));
+    heap_data out(out_sz);
+    int len = LZ4_decompress_safe(
+            reinterpret_cast<const char *>(buf + sizeof(out_sz)),
+            reinterpret_cast<char *>(out.buf), size - sizeof(out_sz), out_sz);
+    if (len < 0 || static_cast<uint32_t>(len) != out_sz)
+        return false;
+    return xwrite(fd, out.buf, out.sz) == static_cast<ssize_t>(out.sz);
+}
+
+static int dump_bin(const uint8_t *buf, size_t sz, embed_codec codec, const char *path, mode_t mode) {
     int fd = xopen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
     if (fd < 0)
         return 1;
-    if (!unxz(fd, buf, sz))
-        return 1;
-    close(fd);
-    return 0;
+    run_finally f([=] { close(fd); });
+    bool ok = codec == embed_codec::LZ4 ? unlz4(fd, buf, sz) : unxz(fd, buf, sz);
+    return ok ? 0 : 1;
 }
 
 void restore_ramdisk_init() {
@@ -60,7 +79,8 @@ void restore_ramdisk_init() {
 }
 
 int dump_preload(const char *path, mode_t mode) {
-    return dump_bin(init_ld_xz, sizeof(init_ld_xz), path, mode);
+    boot_timer t("dump_preload");
+    return dump_bin(init_ld, sizeof(init_ld), init_ld_codec, path, mode);
 }
 
 class RecoveryInit : public BaseInit {
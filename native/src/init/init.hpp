@@ -27,12 +27,30 @@ extern std::vector<std::string> mount_list;
 
 int magisk_proxy_main(int argc, char *argv[]);
 bool unxz(int fd, const uint8_t *buf, size_t size);
+bool unlz4(int fd, const uint8_t *buf, size_t size);
 void load_kernel_info(BootConfig *config);
 bool check_two_stage();
 const char *backup_init();
 void restore_ramdisk_init();
 int dump_preload(const char *path, mode_t mode);
 
+// Log the time spent in a scope, for measuring early boot
+class boot_timer {
+public:
+    explicit boot_timer(const char *name) : name(name) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    ~boot_timer() {
+        timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+        LOGD("timing: %s took %ld us\n", name, us);
+    }
+private:
+    const char *name;
+    timespec start;
+};
+
 /***************
  * Base classes
  ***************/
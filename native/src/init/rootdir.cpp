@@ -159,34 +159,35 @@ static void magic_mount(const string &sdir, const string &ddir = "") {
 }
 
 static void extract_files(bool sbin) {
-    const char *m32 = sbin ? "/sbin/magisk32.xz" : "magisk32.xz";
-    const char *m64 = sbin ? "/sbin/magisk64.xz" : "magisk64.xz";
-    const char *stub_xz = sbin ? "/sbin/stub.xz" : "stub.xz";
-
-    if (access(m32, F_OK) == 0) {
-        auto magisk = mmap_data(m32);
-        unlink(m32);
-        int fd = xopen("magisk32", O_WRONLY | O_CREAT, 0755);
-        unxz(fd, magisk.buf, magisk.sz);
-        close(fd);
-    }
-    if (access(m64, F_OK) == 0) {
-        auto magisk = mmap_data(m64);
-        unlink(m64);
-        int fd = xopen("magisk64", O_WRONLY | O_CREAT, 0755);
-        unxz(fd, magisk.buf, magisk.sz);
+    boot_timer t("extract_files");
+
+    struct xz_job {
+        const char *src;
+        const char *dest;
+        mode_t mode;
+    } jobs[] = {
+        { sbin ? "/sbin/magisk32.xz" : "magisk32.xz", "magisk32", 0755 },
+        { sbin ? "/sbin/magisk64.xz" : "magisk64.xz", "magisk64", 0755 },
+        { sbin ? "/sbin/stub.xz" : "stub.xz", "stub.apk", 0 },
+    };
+
+    // All payloads are independent, decompress them concurrently
+    parallel_for(std::size(jobs), [&](size_t i) {
+        auto &job = jobs[i];
+        if (access(job.src, F_OK) != 0)
+            return;
+        auto m = mmap_data(job.src);
+        unlink(job.src);
+        int fd = xopen(job.dest, O_WRONLY | O_CREAT | O_CLOEXEC, job.mode);
+        unxz(fd, m.buf, m.sz);
         close(fd);
+    });
+
+    if (access("magisk64", F_OK) == 0) {
         xsymlink("./magisk64", "magisk");
     } else {
         xsymlink("./magisk32", "magisk");
     }
-    if (access(stub_xz, F_OK) == 0) {
-        auto stub = mmap_data(stub_xz);
-        unlink(stub_xz);
-        int fd = xopen("stub.apk", O_WRONLY | O_CREAT, 0);
-        unxz(fd, stub.buf, stub.sz);
-        close(fd);
-    }
 }
 
 void MagiskInit::parse_config_file() {
@@ -259,6 +260,18 @@ void MagiskInit::patch_ro_root() {
         mv_path(ROOTOVL "/sbin", ".");
     }
 
+    // A monolithic policy does not depend on anything below,
+    // patch it on another thread while the rootdir is being prepared
+    thread sepol_thread;
+    if (access("/sepolicy.unlocked", F_OK) == 0) {
+        // Oculus Go will use a special sepolicy if unlocked
+        sepol_thread = thread([this] {
+            patch_sepolicy("/sepolicy.unlocked", ROOTOVL "/sepolicy.unlocked");
+        });
+    } else if (access(SPLIT_PLAT_CIL, F_OK) != 0 && access("/sepolicy", F_OK) == 0) {
+        sepol_thread = thread([this] { patch_sepolicy("/sepolicy", ROOTOVL "/sepolicy"); });
+    }
+
     // Patch init.rc
     if (access(NEW_INITRC, F_OK) == 0) {
         // Android 11's new init.rc
@@ -271,11 +284,9 @@ void MagiskInit::patch_ro_root() {
     // Extract magisk
     extract_files(false);
 
-    // Oculus Go will use a special sepolicy if unlocked
-    if (access("/sepolicy.unlocked", F_OK) == 0) {
-        patch_sepolicy("/sepolicy.unlocked", ROOTOVL "/sepolicy.unlocked");
-    } else if ((access(SPLIT_PLAT_CIL, F_OK) != 0 && access("/sepolicy", F_OK) == 0) ||
-               !hijack_sepolicy()) {
+    if (sepol_thread.joinable()) {
+        sepol_thread.join();
+    } else if (!hijack_sepolicy()) {
         patch_sepolicy("/sepolicy", ROOTOVL "/sepolicy");
     }
 
@@ -312,10 +323,6 @@ void MagiskInit::patch_rw_root() {
     rm_rf("/data/overlay.d");
     rm_rf("/.backup");
 
-    // Patch init.rc
-    patch_init_rc("/init.rc", "/init.p.rc", "/sbin");
-    rename("/init.p.rc", "/init.rc");
-
     bool treble;
     {
         auto init = mmap_data("/init");
@@ -328,10 +335,22 @@ void MagiskInit::patch_rw_root() {
     setup_tmp(PRE_TMPDIR);
     chdir(PRE_TMPDIR);
 
+    // Module rules are available once the tmp is setup, the monolithic
+    // policy can then be patched on another thread alongside everything else
+    thread sepol_thread;
+    if (!treble && access("/sepolicy", F_OK) == 0)
+        sepol_thread = thread([this] { patch_sepolicy("/sepolicy", "/sepolicy"); });
+
+    // Patch init.rc
+    patch_init_rc("/init.rc", "/init.p.rc", "/sbin");
+    rename("/init.p.rc", "/init.rc");
+
     // Extract magisk
     extract_files(true);
 
-    if ((!treble && access("/sepolicy", F_OK) == 0) || !hijack_sepolicy()) {
+    if (sepol_thread.joinable()) {
+        sepol_thread.join();
+    } else if (!hijack_sepolicy()) {
         patch_sepolicy("/sepolicy", "/sepolicy");
     }
 
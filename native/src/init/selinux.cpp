@@ -3,11 +3,92 @@
 #include <magisk.hpp>
 #include <sepolicy.hpp>
 #include <base.hpp>
+#include <flags.h>
 
 #include "init.hpp"
 
 using namespace std;
 
+// A patched policy is cached as the binary policy followed by this trailer.
+// magiskinit stages it in tmpfs, and magiskd persists it into the preinit partition.
+struct sepol_cache_trailer {
+    char magic[8];
+    uint64_t key;
+    uint64_t size;
+};
+
+#define SEPOL_CACHE_MAGIC "MGSKPOL1"
+
+static uint64_t policy_key(const byte_data &policy, const vector<pair<string, string>> &rules) {
+    uint64_t h = 0xcbf29ce484222325;
+    auto feed = [&](const void *buf, size_t len) {
+        auto p = static_cast<const uint8_t *>(buf);
+        for (; len >= 8; p += 8, len -= 8) {
+            uint64_t w;
+            memcpy(&w, p, sizeof(w));
+            h ^= w;
+            h = ((h << 31) | (h >> 33)) * 0x100000001b3;
+        }
+        for (; len; ++p, --len)
+            h = (h ^ *p) * 0x100000001b3;
+    };
+    int ver = MAGISK_VER_CODE;
+    feed(&ver, sizeof(ver));
+    // Builds sharing a version code can still differ in magisk_rules()
+    if (auto self = mmap_data("/proc/self/exe"); self.buf)
+        feed(self.buf, self.sz);
+    feed(policy.buf, policy.sz);
+    for (const auto &[bin, text] : rules) {
+        // A compiled file is never older than its text
+        if (bin.empty())
+            feed(text.data(), text.size());
+        else
+            feed(bin.data(), bin.size());
+    }
+    return h;
+}
+
+static bool load_cached_policy(int fd, uint64_t key) {
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) || st.st_size < sizeof(sepol_cache_trailer))
+        return false;
+    auto buf = static_cast<uint8_t *>(xmmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (buf == nullptr)
+        return false;
+    run_finally f([=] { munmap(buf, st.st_size); });
+
+    sepol_cache_trailer t;
+    memcpy(&t, buf + st.st_size - sizeof(t), sizeof(t));
+    if (memcmp(t.magic, SEPOL_CACHE_MAGIC, sizeof(t.magic)) != 0 || t.key != key ||
+        t.size != st.st_size - sizeof(t))
+        return false;
+
+    LOGD("Loading cached sepolicy\n");
+    int load = xopen(SELINUX_LOAD, O_WRONLY | O_CLOEXEC);
+    if (load < 0)
+        return false;
+    // selinuxfs does not allow partial writes, the whole policy has to go in one call
+    bool ok = xwrite(load, buf, t.size) == t.size;
+    close(load);
+    return ok;
+}
+
+static void stage_cached_policy(const byte_data &policy, uint64_t key) {
+    int fd = xopen(SEPOLCACHE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    sepol_cache_trailer t{};
+    memcpy(t.magic, SEPOL_CACHE_MAGIC, sizeof(t.magic));
+    t.key = key;
+    t.size = policy.sz;
+    if (xwrite(fd, policy.buf, policy.sz) != policy.sz || xwrite(fd, &t, sizeof(t)) != sizeof(t)) {
+        close(fd);
+        unlink(SEPOLCACHE);
+        return;
+    }
+    close(fd);
+}
+
 void MagiskInit::patch_sepolicy(const char *in, const char *out) {
     LOGD("Patching monolithic policy\n");
     auto sepol = unique_ptr<sepolicy>(sepolicy::from_file(in));
@@ -17,6 +98,9 @@ void MagiskInit::patch_sepolicy(const char *in, const char *out) {
     // Custom rules
     if (auto dir = xopen_dir("/data/" PREINITMIRR)) {
         for (dirent *entry; (entry = xreaddir(dir.get()));) {
+            // Dot entries are Magisk's own files, not modules
+            if (entry->d_name[0] == '.')
+                continue;
             auto name = "/data/" PREINITMIRR "/"s + entry->d_name;
             auto rule = name + "/sepolicy.rule";
             if (xaccess(rule.data(), R_OK) == 0 &&
@@ -95,24 +179,34 @@ bool MagiskInit::hijack_sepolicy() {
         hijack();
     }
 
-    // Read all custom rules into memory
-    string rules;
+    // Read all custom rules into memory in directory order, as pairs of the compiled
+    // form (if any, it lets the module skip parsing) and the text
+    vector<pair<string, string>> rules;
     if (auto dir = xopen_dir("/data/" PREINITMIRR)) {
         for (dirent *entry; (entry = xreaddir(dir.get()));) {
+            // Dot entries are Magisk's own files, not modules
+            if (entry->d_name[0] == '.')
+                continue;
             auto name = "/data/" PREINITMIRR "/"s + entry->d_name;
             auto rule_file = name + "/sepolicy.rule";
             if (xaccess(rule_file.data(), R_OK) == 0 &&
                 access((name + "/disable").data(), F_OK) != 0 &&
                 access((name + "/remove").data(), F_OK) != 0) {
                 LOGD("Load custom sepolicy patch: [%s]\n", rule_file.data());
-                full_read(rule_file.data(), rules);
-                rules += '\n';
+                // Keep the text around in case the compiled form turns out to be invalid
+                rules.emplace_back(sepolicy::read_compiled_rules(rule_file.data()),
+                                   full_read(rule_file.data()));
             }
         }
     }
+    // The preinit mirror will be gone by the time init loads its policy
+    int cache_fd = open("/data/" PREINITCACHE, O_RDONLY | O_CLOEXEC);
+
     // Create a new process waiting for init operations
     if (xfork()) {
         // In parent, return and continue boot process
+        if (cache_fd >= 0)
+            close(cache_fd);
         return true;
     }
 
@@ -139,13 +233,27 @@ bool MagiskInit::hijack_sepolicy() {
     xumount2(SELINUX_LOAD, MNT_DETACH);
     xumount2(SELINUX_ENFORCE, MNT_DETACH);
 
-    // Load and patch policy
-    auto sepol = unique_ptr<sepolicy>(sepolicy::from_file(MOCK_LOAD));
-    sepol->magisk_rules();
-    sepol->load_rules(rules);
+    // Reuse the policy patched on a previous boot if nothing it was built from changed
+    auto policy = mmap_data(MOCK_LOAD);
+    uint64_t key = policy_key(policy, rules);
+    if (!load_cached_policy(cache_fd, key)) {
+        // Load and patch policy
+        auto sepol = unique_ptr<sepolicy>(sepolicy::from_data((char *) policy.buf, policy.sz));
+        sepol->magisk_rules();
+        for (const auto &[bin, text] : rules) {
+            if (bin.empty() || !sepol->load_compiled_rules(bin))
+                sepol->load_rules(text);
+        }
 
-    // Load patched policy into kernel
-    sepol->to_file(SELINUX_LOAD);
+        // Load patched policy into kernel, and keep a copy for magiskd to persist
+        if (auto patched = sepol->to_data(); patched.buf) {
+            sepol.reset();
+            int load = xopen(SELINUX_LOAD, O_WRONLY | O_CLOEXEC);
+            xwrite(load, patched.buf, patched.sz);
+            close(load);
+            stage_cached_policy(patched, key);
+        }
+    }
 
     // Write to the enforce node ONLY after sepolicy is loaded. We need to make sure
     // the actual init process is blocked until sepolicy is loaded, or else
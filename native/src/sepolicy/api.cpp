@@ -104,10 +104,24 @@ bool sepolicy::exists(const char *type) {
     return hashtab_search(impl->db->p_types.table, type) != nullptr;
 }
 
+bool sepolicy::query(const char *s, const char *t, const char *c) {
+    return impl->query(s, t, c);
+}
+
+void sepolicy::optimize() {
+    impl->optimize();
+}
+
 void sepolicy::load_rule_file(const char *file) {
-    rust::load_rule_file(*this, u8_slice(file, strlen(file)));
+    impl->begin_batch();
+    // Prefer the compiled form installed next to the rule file
+    if (auto bin = read_compiled_rules(file); bin.empty() || !load_compiled_rules(bin))
+        rust::load_rule_file(*this, u8_slice(file, strlen(file)));
+    impl->commit_batch();
 }
 
 void sepolicy::load_rules(const std::string &rules) {
+    impl->begin_batch();
     rust::load_rules(*this, u8_slice(rules.data(), rules.length()));
+    impl->commit_batch();
 }
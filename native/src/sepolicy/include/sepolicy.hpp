@@ -7,6 +7,8 @@
 
 #define ALL nullptr
 
+struct heap_data;
+
 struct sepolicy {
     using c_str = const char *;
 
@@ -18,11 +20,18 @@ struct sepolicy {
 
     // External APIs
     bool to_file(c_str file);
+    heap_data to_data();
     void parse_statement(c_str stmt, int len);
     void parse_statement(c_str stmt) { parse_statement(stmt, strlen(stmt)); }
+    bool query(c_str src, c_str tgt, c_str cls);
     void load_rules(const std::string &rules);
     void load_rule_file(c_str file);
 
+    // Rule files precompiled into a list of expanded statements
+    static bool compile_rule_file(c_str in, c_str out);
+    static std::string read_compiled_rules(c_str file);
+    bool load_compiled_rules(const std::string &data);
+
     // Operation on types
     bool type(c_str name, c_str attr);
     bool attribute(c_str name);
@@ -53,9 +62,15 @@ struct sepolicy {
     // Magisk
     void magisk_rules();
 
+    // Drop rules made redundant by rules on attributes
+    void optimize();
+
     // Deprecate
     bool create(c_str name) { return type(name, "domain"); }
 
+    // Instances are always deleted through this type, make sure the policydb is freed
+    virtual ~sepolicy() = default;
+
 protected:
     // Prevent anyone from accidentally creating an instance
     sepolicy() = default;
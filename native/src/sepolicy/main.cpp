@@ -1,5 +1,7 @@
+#include <sys/resource.h>
 #include <base.hpp>
 #include <vector>
+#include <array>
 
 #include "policy.hpp"
 
@@ -20,9 +22,23 @@ Options:
    --save FILE       dump monolithic sepolicy to FILE
    --live            immediately load sepolicy into the kernel
    --magisk          apply built-in Magisk sepolicy rules
+   --optimize        drop rules between types that are already
+                     granted by rules on their attributes; a later
+                     deny on an attribute rule then also removes
+                     what the dropped type rules granted
    --apply FILE      apply rules from FILE, read and parsed
                      line by line as policy statements
                      (multiple --apply are allowed)
+   --bench           print time, avtab size and peak memory
+                     after each phase
+   --query SRC TGT CLASS
+                     print all rules the kernel would consult for
+                     SRC accessing TGT as CLASS, including those on
+                     their attributes, '*' matches anything
+   --compile-rules IN OUT
+                     compile rule file IN into binary form at OUT
+                     (FILE.bin is preferred over FILE by --apply
+                     if it is not older than FILE)
 
 If neither --load, --load-split, nor --compile-split is specified,
 it will load from current live policies (/sys/fs/selinux/policy)
@@ -31,13 +47,58 @@ it will load from current live policies (/sys/fs/selinux/policy)
     exit(1);
 }
 
+// Per phase timing, collected unconditionally and printed with --bench
+class phase_stats {
+    struct phase {
+        const char *name;
+        long usec;
+        uint32_t nel;
+        uint32_t cond_nel;
+    };
+    vector<phase> phases;
+    timespec last;
+
+    static timespec now() {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts;
+    }
+public:
+    phase_stats() : last(now()) {}
+
+    void mark(const char *name, sepolicy *sepol) {
+        auto ts = now();
+        long usec = (ts.tv_sec - last.tv_sec) * 1000000L + (ts.tv_nsec - last.tv_nsec) / 1000;
+        auto db = static_cast<sepol_impl *>(sepol)->db;
+        phases.push_back({ name, usec, db->te_avtab.nel, db->te_cond_avtab.nel });
+        last = now();
+    }
+
+    void print() {
+        long total = 0;
+        fprintf(stderr, "%-12s %10s %10s %10s\n", "phase", "time (ms)", "avtab", "cond");
+        for (auto &p : phases) {
+            total += p.usec;
+            fprintf(stderr, "%-12s %10.2f %10u %10u\n", p.name, p.usec / 1000.0, p.nel, p.cond_nel);
+        }
+        rusage ru{};
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(stderr, "%-12s %10.2f\n", "total", total / 1000.0);
+        fprintf(stderr, "peak rss     %7ld KiB\n", ru.ru_maxrss);
+    }
+};
+
 int main(int argc, char *argv[]) {
     cmdline_logging();
+    phase_stats stats;
     const char *out_file = nullptr;
     vector<string_view> rule_files;
+    vector<array<const char *, 3>> queries;
     sepolicy *sepol = nullptr;
     bool magisk = false;
     bool live = false;
+    bool optimize = false;
+    bool bench = false;
 
     if (argc < 2) usage(argv[0]);
     int i = 1;
@@ -49,6 +110,10 @@ int main(int argc, char *argv[]) {
                 live = true;
             else if (option == "magisk"sv)
                 magisk = true;
+            else if (option == "optimize"sv)
+                optimize = true;
+            else if (option == "bench"sv)
+                bench = true;
             else if (option == "load"sv) {
                 if (argv[i + 1] == nullptr)
                     usage(argv[0]);
@@ -57,6 +122,7 @@ int main(int argc, char *argv[]) {
                     fprintf(stderr, "Cannot load policy from %s\n", argv[i + 1]);
                     return 1;
                 }
+                stats.mark("load", sepol);
                 ++i;
             } else if (option == "load-split"sv) {
                 sepol = sepolicy::from_split();
@@ -64,12 +130,14 @@ int main(int argc, char *argv[]) {
                     fprintf(stderr, "Cannot load split cil\n");
                     return 1;
                 }
+                stats.mark("load-split", sepol);
             } else if (option == "compile-split"sv) {
                 sepol = sepolicy::compile_split();
                 if (!sepol) {
                     fprintf(stderr, "Cannot compile split cil\n");
                     return 1;
                 }
+                stats.mark("compile", sepol);
             } else if (option == "save"sv) {
                 if (argv[i + 1] == nullptr)
                     usage(argv[0]);
@@ -80,6 +148,16 @@ int main(int argc, char *argv[]) {
                     usage(argv[0]);
                 rule_files.emplace_back(argv[i + 1]);
                 ++i;
+            } else if (option == "query"sv) {
+                if (argv[i + 1] == nullptr || argv[i + 2] == nullptr || argv[i + 3] == nullptr)
+                    usage(argv[0]);
+                auto any = [](const char *s) { return s == "*"sv ? nullptr : s; };
+                queries.push_back({ any(argv[i + 1]), any(argv[i + 2]), any(argv[i + 3]) });
+                i += 3;
+            } else if (option == "compile-rules"sv) {
+                if (argv[i + 1] == nullptr || argv[i + 2] == nullptr)
+                    usage(argv[0]);
+                return sepolicy::compile_rule_file(argv[i + 1], argv[i + 2]) ? 0 : 1;
             } else if (option == "help"sv) {
                 statement_help();
             } else {
@@ -91,20 +169,46 @@ int main(int argc, char *argv[]) {
     }
 
     // Use current policy if nothing is loaded
-    if (sepol == nullptr && !(sepol = sepolicy::from_file(SELINUX_POLICY))) {
-        fprintf(stderr, "Cannot load policy from " SELINUX_POLICY "\n");
-        return 1;
+    if (sepol == nullptr) {
+        if (!(sepol = sepolicy::from_file(SELINUX_POLICY))) {
+            fprintf(stderr, "Cannot load policy from " SELINUX_POLICY "\n");
+            return 1;
+        }
+        stats.mark("load", sepol);
     }
 
-    if (magisk)
+    if (magisk) {
         sepol->magisk_rules();
+        stats.mark("magisk", sepol);
+    }
 
-    if (!rule_files.empty())
+    if (!rule_files.empty()) {
         for (const auto &rule_file : rule_files)
             sepol->load_rule_file(rule_file.data());
+        stats.mark("apply", sepol);
+    }
 
-    for (; i < argc; ++i)
-        sepol->parse_statement(argv[i]);
+    if (i < argc) {
+        for (; i < argc; ++i)
+            sepol->parse_statement(argv[i]);
+        stats.mark("statements", sepol);
+    }
+
+    if (optimize) {
+        sepol->optimize();
+        stats.mark("optimize", sepol);
+    }
+
+    if (bench) {
+        sepol->to_data();
+        stats.mark("serialize", sepol);
+        stats.print();
+    }
+
+    for (const auto &q : queries) {
+        if (!sepol->query(q[0], q[1], q[2]))
+            return 1;
+    }
 
     if (live && !sepol->to_file(SELINUX_LOAD)) {
         fprintf(stderr, "Cannot apply policy\n");
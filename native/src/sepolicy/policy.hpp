@@ -2,11 +2,20 @@
 
 // Internal APIs, do not use directly
 
+#include <vector>
+
 #include <sepol/policydb/policydb.h>
 #include <sepolicy.hpp>
 
 #include "policy-rs.hpp"
 
+// A pending access vector update: data = (data & keep) | set
+struct av_op {
+    uint64_t key;   /* source, target, class, specified: 16 bits each */
+    uint32_t keep;
+    uint32_t set;
+};
+
 struct sepol_impl : public sepolicy {
     avtab_ptr_t get_avtab_node(avtab_key_t *key, avtab_extended_perms_t *xperms);
     bool add_rule(const char *s, const char *t, const char *c, const char *p, int effect, bool invert);
@@ -22,11 +31,23 @@ struct sepol_impl : public sepolicy {
     void add_typeattribute(type_datum_t *type, type_datum_t *attr);
     bool add_typeattribute(const char *type, const char *attr);
     void strip_dontaudit();
+    void optimize();
+    void print_rule(avtab_ptr_t node, bool cond);
+    bool query(const char *s, const char *t, const char *c);
+
+    // While a batch is open, access vector rules are only recorded and
+    // get resolved against the avtab all at once when the batch is committed
+    void begin_batch() { ++batch_depth; }
+    void commit_batch();
 
     sepol_impl(policydb *db) : db(db) {}
     ~sepol_impl();
 
     policydb *db;
+
+private:
+    int batch_depth = 0;
+    std::vector<av_op> av_batch;
 };
 
 #define impl reinterpret_cast<sepol_impl *>(this)
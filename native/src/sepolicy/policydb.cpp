@@ -6,7 +6,6 @@
 #include <cil/cil.h>
 
 #include <base.hpp>
-#include <stream.hpp>
 
 #include "policy.hpp"
 
@@ -233,20 +232,34 @@ sepol_impl::~sepol_impl() {
     free(db);
 }
 
-bool sepolicy::to_file(const char *file) {
-    // No partial writes are allowed to /sys/fs/selinux/load, thus the reason why we
-    // first dump everything into memory, then directly call write system call
-    heap_data data;
-    auto fp = make_channel_fp<byte_channel>(data);
-
+heap_data sepolicy::to_data() {
+    // Measure the image first, so it can be serialized straight into one exactly sized buffer
     policy_file_t pf;
     policy_file_init(&pf);
-    pf.type = PF_USE_STDIO;
-    pf.fp = fp.get();
+    pf.type = PF_LEN;
     if (policydb_write(impl->db, &pf)) {
         LOGE("Fail to create policy image\n");
-        return false;
+        return {};
+    }
+
+    heap_data data(pf.len);
+    policy_file_init(&pf);
+    pf.type = PF_USE_MEMORY;
+    pf.data = reinterpret_cast<char *>(data.buf);
+    pf.len = data.sz;
+    if (policydb_write(impl->db, &pf) || pf.len != 0) {
+        LOGE("Fail to create policy image\n");
+        return {};
     }
+    return data;
+}
+
+bool sepolicy::to_file(const char *file) {
+    // No partial writes are allowed to /sys/fs/selinux/load, thus the reason why we
+    // first dump everything into memory, then directly call write system call
+    auto data = to_data();
+    if (data.buf == nullptr)
+        return false;
 
     int fd = xopen(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
     if (fd < 0)
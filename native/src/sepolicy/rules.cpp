@@ -7,6 +7,7 @@ using namespace std;
 void sepolicy::magisk_rules() {
     // Temp suppress warnings
     set_log_level_state(LogLevel::Warn, false);
+    impl->begin_batch();
 
     // Prevent anything to change sepolicy except ourselves
     deny(ALL, "kernel", "security", "load_policy");
@@ -119,6 +120,8 @@ void sepolicy::magisk_rules() {
     // Allow update_engine/addon.d-v2 to run permissive on all ROMs
     permissive("update_engine");
 
+    impl->commit_batch();
+
 #if 0
     // Remove all dontaudit in debug mode
     impl->strip_dontaudit();
@@ -101,6 +101,118 @@ static bool is_redundant(avtab_ptr_t node) {
     }
 }
 
+// Grow the hash table to fit nrules, using the same sizing as avtab_alloc
+static void avtab_reserve(avtab_t *h, uint32_t nrules) {
+    uint32_t shift = 0;
+    for (uint32_t work = nrules; work; work >>= 1)
+        ++shift;
+    if (shift > 2)
+        shift -= 2;
+    uint32_t nslot = std::min(UINT32_C(1) << shift, (uint32_t) MAX_AVTAB_HASH_BUCKETS);
+    if (nslot <= h->nslot)
+        return;
+    avtab_ptr_t *htable = auto_cast(calloc(nslot, sizeof(avtab_ptr_t)));
+    if (htable == nullptr)
+        return;
+
+    // Each new bucket is fed by exactly one old bucket, so pushing every old chain
+    // in reverse keeps the new chains sorted, which avtab_search_node relies on
+    uint32_t mask = nslot - 1;
+    std::vector<avtab_ptr_t> chain;
+    for (uint32_t i = 0; i < h->nslot; ++i) {
+        chain.clear();
+        for (avtab_ptr_t cur = h->htable[i]; cur; cur = cur->next)
+            chain.push_back(cur);
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            int hvalue = avtab_hash(&(*it)->key, mask);
+            (*it)->next = htable[hvalue];
+            htable[hvalue] = *it;
+        }
+    }
+    free(h->htable);
+    h->htable = htable;
+    h->nslot = nslot;
+    h->mask = mask;
+}
+
+static uint64_t av_key(const avtab_key_t &key) {
+    return (uint64_t) key.source_type << 48 | (uint64_t) key.target_type << 32 |
+           (uint64_t) key.target_class << 16 |
+           (key.specified & ~(AVTAB_ENABLED | AVTAB_ENABLED_OLD));
+}
+
+void sepol_impl::commit_batch() {
+    if (batch_depth == 0 || --batch_depth > 0)
+        return;
+    if (av_batch.empty())
+        return;
+
+    // Fold all updates to the same key in the order they were issued.
+    // The packed key sorts the same way as avtab chains.
+    std::stable_sort(av_batch.begin(), av_batch.end(),
+                     [](const av_op &a, const av_op &b) { return a.key < b.key; });
+    size_t n = 0;
+    for (auto &op : av_batch) {
+        if (n && av_batch[n - 1].key == op.key) {
+            auto &prev = av_batch[n - 1];
+            prev.set = (prev.set & op.keep) | op.set;
+            prev.keep &= op.keep;
+        } else {
+            av_batch[n++] = op;
+        }
+    }
+    av_batch.resize(n);
+    std::vector<bool> applied(n);
+
+    // Update existing nodes in a single pass over all buckets
+    avtab_t *h = &db->te_avtab;
+    for (uint32_t i = 0; i < h->nslot; ++i) {
+        avtab_ptr_t prev = nullptr;
+        for (avtab_ptr_t cur = h->htable[i], next; cur; cur = next) {
+            next = cur->next;
+            uint64_t key = av_key(cur->key);
+            auto it = std::lower_bound(av_batch.begin(), av_batch.end(), key,
+                                       [](const av_op &op, uint64_t k) { return op.key < k; });
+            if (it != av_batch.end() && it->key == key && !applied[it - av_batch.begin()]) {
+                applied[it - av_batch.begin()] = true;
+                cur->datum.data = (cur->datum.data & it->keep) | it->set;
+                if (is_redundant(cur)) {
+                    if (prev)
+                        prev->next = next;
+                    else
+                        h->htable[i] = next;
+                    h->nel--;
+                    free(cur);
+                    continue;
+                }
+            }
+            prev = cur;
+        }
+    }
+
+    // Insert the rest into a table sized for them up front
+    avtab_reserve(h, h->nel + std::count(applied.begin(), applied.end(), false));
+    for (size_t i = 0; i < n; ++i) {
+        if (applied[i])
+            continue;
+        auto &op = av_batch[i];
+        avtab_key_t key;
+        key.source_type = op.key >> 48;
+        key.target_type = op.key >> 32;
+        key.target_class = op.key >> 16;
+        key.specified = op.key;
+        avtab_datum_t avdatum{};
+        avdatum.data = key.specified == AVTAB_AUDITDENY ? ~0U : 0U;
+        avdatum.data = (avdatum.data & op.keep) | op.set;
+        if (avdatum.data == (key.specified == AVTAB_AUDITDENY ? ~0U : 0U))
+            continue;
+        avtab_insert_nonunique(h, &key, &avdatum);
+    }
+
+    av_batch.clear();
+    av_batch.shrink_to_fit();
+}
+
 avtab_ptr_t sepol_impl::get_avtab_node(avtab_key_t *key, avtab_extended_perms_t *xperms) {
     avtab_ptr_t node;
 
@@ -170,6 +282,15 @@ void sepol_impl::add_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *c
         key.target_class = cls->s.value;
         key.specified = effect;
 
+        if (batch_depth) {
+            uint32_t bits = perm ? 1U << (perm->s.value - 1) : ~0U;
+            if (invert)
+                av_batch.push_back({ av_key(key), ~bits, 0U });
+            else
+                av_batch.push_back({ av_key(key), ~0U, bits });
+            return;
+        }
+
         avtab_ptr_t node = get_avtab_node(&key, nullptr);
         if (invert) {
             if (perm)
@@ -602,8 +723,290 @@ bool sepol_impl::add_typeattribute(const char *type, const char *attr) {
 }
 
 void sepol_impl::strip_dontaudit() {
+    // Pending rules have to be in the avtab first
+    if (batch_depth) {
+        batch_depth = 1;
+        commit_batch();
+    }
     avtab_for_each(&db->te_avtab, [=](avtab_ptr_t node) {
         if (node->key.specified == AVTAB_AUDITDENY || node->key.specified == AVTAB_XPERMS_DONTAUDIT)
             avtab_remove_node(&db->te_avtab, node);
     });
 }
+
+// Reduce rules between two concrete types by the permissions they already get through rules
+// on attributes the types belong to, the same way the kernel combines them on lookup.
+// Rules involving attributes are never touched, so types added to attributes later
+// through live patching still get everything they would have had.
+// The reverse does not hold: a later deny on an attribute rule also takes away
+// what the dropped type rules granted, so this is only done on request.
+void sepol_impl::optimize() {
+    // Pending rules have to be in the avtab first
+    if (batch_depth) {
+        batch_depth = 1;
+        commit_batch();
+    }
+
+    avtab_t *h = &db->te_avtab;
+    uint32_t ntypes = db->p_types.nprim;
+    auto is_attr = [&](uint32_t v) {
+        return db->type_val_to_struct[v - 1]->flavor == TYPE_ATTRIB;
+    };
+    auto kind = [](const avtab_key_t &key) -> int {
+        int specified = key.specified & ~(AVTAB_ENABLED | AVTAB_ENABLED_OLD);
+        return specified == AVTAB_ALLOWED || specified == AVTAB_AUDITALLOW ? specified : 0;
+    };
+
+    // Only types used on that side of some attribute rule can contribute anything
+    std::vector<bool> src_used(ntypes + 1), tgt_used(ntypes + 1);
+    avtab_for_each(h, [&](avtab_ptr_t node) {
+        if (kind(node->key) &&
+            (is_attr(node->key.source_type) || is_attr(node->key.target_type))) {
+            src_used[node->key.source_type] = true;
+            tgt_used[node->key.target_type] = true;
+        }
+    });
+
+    // The type itself and its attributes, filtered by usage and built on demand
+    std::vector<std::vector<uint32_t>> src_attrs(ntypes + 1), tgt_attrs(ntypes + 1);
+    std::vector<bool> attrs_built(ntypes + 1);
+    auto build_attrs = [&](uint32_t v) {
+        if (attrs_built[v])
+            return;
+        attrs_built[v] = true;
+        ebitmap_node_t *n;
+        uint32_t bit;
+        ebitmap_for_each_positive_bit(&db->type_attr_map[v - 1], n, bit) {
+            if (src_used[bit + 1])
+                src_attrs[v].push_back(bit + 1);
+            if (tgt_used[bit + 1])
+                tgt_attrs[v].push_back(bit + 1);
+        }
+    };
+    auto covered_by_attrs = [&](const avtab_key_t &key, uint32_t data) -> uint32_t {
+        uint32_t covered = 0;
+        avtab_key_t k;
+        k.target_class = key.target_class;
+        k.specified = kind(key);
+        for (uint32_t s : src_attrs[key.source_type]) {
+            for (uint32_t t : tgt_attrs[key.target_type]) {
+                if (s == key.source_type && t == key.target_type)
+                    continue;
+                k.source_type = s;
+                k.target_type = t;
+                if (avtab_datum_t *d = avtab_search(h, &k)) {
+                    covered |= d->data;
+                    if ((data & ~covered) == 0)
+                        return covered;
+                }
+            }
+        }
+        return covered;
+    };
+
+    uint32_t nel = h->nel;
+    uint64_t perms = 0;
+    for (uint32_t i = 0; i < h->nslot; ++i) {
+        avtab_ptr_t prev = nullptr;
+        for (avtab_ptr_t cur = h->htable[i], next; cur; cur = next) {
+            next = cur->next;
+            auto &key = cur->key;
+            if (kind(key) && !is_attr(key.source_type) && !is_attr(key.target_type)) {
+                build_attrs(key.source_type);
+                build_attrs(key.target_type);
+                uint32_t covered = covered_by_attrs(key, cur->datum.data) & cur->datum.data;
+                perms += __builtin_popcount(covered);
+                cur->datum.data &= ~covered;
+                if (is_redundant(cur)) {
+                    if (prev)
+                        prev->next = next;
+                    else
+                        h->htable[i] = next;
+                    h->nel--;
+                    free(cur);
+                    continue;
+                }
+            }
+            prev = cur;
+        }
+    }
+    LOGI("Optimize policy: %u -> %u access vector rules, %llu redundant permissions\n",
+         nel, h->nel, (unsigned long long) perms);
+}
+
+static const struct {
+    uint16_t kind;
+    const char *name;
+} avtab_kinds[] = {
+    { AVTAB_ALLOWED, "allow" },
+    { AVTAB_AUDITALLOW, "auditallow" },
+    { AVTAB_AUDITDENY, "dontaudit" },
+    { AVTAB_TRANSITION, "type_transition" },
+    { AVTAB_MEMBER, "type_member" },
+    { AVTAB_CHANGE, "type_change" },
+    { AVTAB_XPERMS_ALLOWED, "allowxperm" },
+    { AVTAB_XPERMS_AUDITALLOW, "auditallowxperm" },
+    { AVTAB_XPERMS_DONTAUDIT, "dontauditxperm" },
+};
+
+void sepol_impl::print_rule(avtab_ptr_t node, bool cond) {
+    auto &key = node->key;
+    int specified = key.specified & ~(AVTAB_ENABLED | AVTAB_ENABLED_OLD);
+    const char *kind = "?";
+    for (auto &k : avtab_kinds) {
+        if (k.kind == specified)
+            kind = k.name;
+    }
+
+    std::string s = kind;
+    s += ' ';
+    s += db->p_type_val_to_name[key.source_type - 1];
+    s += ' ';
+    s += db->p_type_val_to_name[key.target_type - 1];
+    s += ':';
+    s += db->p_class_val_to_name[key.target_class - 1];
+
+    if (specified & AVTAB_AV) {
+        // Denied permissions are the ones not audited
+        uint32_t data = specified == AVTAB_AUDITDENY ? ~node->datum.data : node->datum.data;
+        const char *names[32] = {};
+        class_datum_t *cls = db->class_val_to_struct[key.target_class - 1];
+        auto collect = [&](hashtab_ptr_t n) {
+            auto perm = static_cast<perm_datum_t *>(n->datum);
+            names[perm->s.value - 1] = n->key;
+        };
+        if (cls->comdatum)
+            hashtab_for_each(cls->comdatum->permissions.table, collect);
+        hashtab_for_each(cls->permissions.table, collect);
+        s += " {";
+        for (int i = 0; i < 32; ++i) {
+            if (data & (1U << i)) {
+                char buf[16];
+                if (names[i] == nullptr)
+                    ssprintf(buf, sizeof(buf), "0x%08X", 1U << i);
+                s += ' ';
+                s += names[i] ? names[i] : buf;
+            }
+        }
+        s += " }";
+    } else if (specified & AVTAB_TYPE) {
+        s += ' ';
+        s += db->p_type_val_to_name[node->datum.data - 1];
+    } else if (auto xperms = node->datum.xperms) {
+        // Print as ranges of the ioctl numbers covered
+        s += " ioctl {";
+        char buf[32];
+        for (int i = 0; i < 256;) {
+            if (!xperm_test(i, xperms->perms)) {
+                ++i;
+                continue;
+            }
+            int j = i;
+            while (j + 1 < 256 && xperm_test(j + 1, xperms->perms))
+                ++j;
+            int low, high;
+            if (xperms->specified == AVTAB_XPERMS_IOCTLDRIVER) {
+                low = i << 8;
+                high = j << 8 | 0xFF;
+            } else {
+                low = xperms->driver << 8 | i;
+                high = xperms->driver << 8 | j;
+            }
+            if (low == high)
+                ssprintf(buf, sizeof(buf), " 0x%04X", low);
+            else
+                ssprintf(buf, sizeof(buf), " 0x%04X-0x%04X", low, high);
+            s += buf;
+            i = j + 1;
+        }
+        s += " }";
+    }
+    if (cond)
+        s += (key.specified & AVTAB_ENABLED) ? " [cond, enabled]" : " [cond, disabled]";
+    printf("%s\n", s.data());
+}
+
+// The kernel looks up rules for a type through all of its attributes,
+// so a type matches rules on itself and its attributes. An attribute only matches itself.
+bool sepol_impl::query(const char *s, const char *t, const char *c) {
+    type_datum_t *src = nullptr, *tgt = nullptr;
+    class_datum_t *cls = nullptr;
+
+    if (s && (src = hashtab_find(db->p_types.table, s)) == nullptr) {
+        LOGW("source type %s does not exist\n", s);
+        return false;
+    }
+    if (t && (tgt = hashtab_find(db->p_types.table, t)) == nullptr) {
+        LOGW("target type %s does not exist\n", t);
+        return false;
+    }
+    if (c && (cls = hashtab_find(db->p_classes.table, c)) == nullptr) {
+        LOGW("class %s does not exist\n", c);
+        return false;
+    }
+
+    auto expand = [&](type_datum_t *type) {
+        std::vector<uint32_t> vals;
+        if (type->flavor == TYPE_ATTRIB) {
+            vals.push_back(type->s.value);
+        } else {
+            ebitmap_node_t *n;
+            uint32_t bit;
+            ebitmap_for_each_positive_bit(&db->type_attr_map[type->s.value - 1], n, bit)
+                vals.push_back(bit + 1);
+        }
+        return vals;
+    };
+
+    avtab_t *tables[] = { &db->te_avtab, &db->te_cond_avtab };
+    constexpr uint16_t all_kinds = AVTAB_AV | AVTAB_TYPE | AVTAB_XPERMS;
+
+    if (src && tgt) {
+        // Direct lookups on every (source, target, class) the kernel would consult
+        auto srcs = expand(src);
+        auto tgts = expand(tgt);
+        uint32_t cls_begin = cls ? cls->s.value : 1;
+        uint32_t cls_end = cls ? cls->s.value : db->p_classes.nprim;
+        for (uint32_t sv : srcs) {
+            for (uint32_t tv : tgts) {
+                for (uint32_t cv = cls_begin; cv <= cls_end; ++cv) {
+                    avtab_key_t key;
+                    key.source_type = sv;
+                    key.target_type = tv;
+                    key.target_class = cv;
+                    key.specified = all_kinds;
+                    for (avtab_t *h : tables) {
+                        for (avtab_ptr_t node = avtab_search_node(h, &key); node;
+                             node = avtab_search_node_next(node, all_kinds)) {
+                            print_rule(node, h == &db->te_cond_avtab);
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // With a wildcard on either side, filter every rule instead
+    std::vector<bool> src_match, tgt_match;
+    if (src) {
+        src_match.resize(db->p_types.nprim + 1);
+        for (uint32_t v : expand(src))
+            src_match[v] = true;
+    }
+    if (tgt) {
+        tgt_match.resize(db->p_types.nprim + 1);
+        for (uint32_t v : expand(tgt))
+            tgt_match[v] = true;
+    }
+    for (avtab_t *h : tables) {
+        avtab_for_each(h, [&](avtab_ptr_t node) {
+            if ((src && !src_match[node->key.source_type]) ||
+                (tgt && !tgt_match[node->key.target_type]) ||
+                (cls && node->key.target_class != cls->s.value))
+                return;
+            print_rule(node, h == &db->te_cond_avtab);
+        });
+    }
+    return true;
+}
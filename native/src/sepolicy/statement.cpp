@@ -1,6 +1,7 @@
 #include <cstring>
 #include <vector>
 #include <string>
+#include <map>
 
 #include <base.hpp>
 
@@ -265,16 +266,74 @@ static bool parse_pattern_9(const Func &fn, const char *action, char *stmt) {
     return true;
 }
 
-#define add_action_func(name, type, fn) \
+// Every statement kind, in the order they are stored in compiled rule files
+enum class rule_act : uint8_t {
+    allow,
+    deny,
+    auditallow,
+    dontaudit,
+    allowxperm,
+    auditallowxperm,
+    dontauditxperm,
+    permissive,
+    enforce,
+    typeattribute,
+    type,
+    attribute,
+    type_transition,
+    type_change,
+    type_member,
+    genfscon,
+    create,
+    END
+};
+
+// Number of arguments each statement kind is called with after expansion
+static const uint8_t act_argc[] = { 4, 4, 4, 4, 4, 4, 4, 1, 1, 2, 2, 1, 5, 4, 4, 3, 1 };
+static_assert(sizeof(act_argc) == (int) rule_act::END);
+
+static const char *rule_names[] = {
+    "allow", "deny", "auditallow", "dontaudit", "allowxperm", "auditallowxperm",
+    "dontauditxperm", "permissive", "enforce", "typeattribute", "type", "attribute",
+    "type_transition", "type_change", "type_member", "genfscon", "create"
+};
+static_assert(size(rule_names) == (int) rule_act::END);
+
+static bool exec_rule(sepolicy &sepol, rule_act act, const char * const *a) {
+    switch (act) {
+    case rule_act::allow: return sepol.allow(a[0], a[1], a[2], a[3]);
+    case rule_act::deny: return sepol.deny(a[0], a[1], a[2], a[3]);
+    case rule_act::auditallow: return sepol.auditallow(a[0], a[1], a[2], a[3]);
+    case rule_act::dontaudit: return sepol.dontaudit(a[0], a[1], a[2], a[3]);
+    case rule_act::allowxperm: return sepol.allowxperm(a[0], a[1], a[2], a[3]);
+    case rule_act::auditallowxperm: return sepol.auditallowxperm(a[0], a[1], a[2], a[3]);
+    case rule_act::dontauditxperm: return sepol.dontauditxperm(a[0], a[1], a[2], a[3]);
+    case rule_act::permissive: return sepol.permissive(a[0]);
+    case rule_act::enforce: return sepol.enforce(a[0]);
+    case rule_act::typeattribute: return sepol.typeattribute(a[0], a[1]);
+    case rule_act::type: return sepol.type(a[0], a[1]);
+    case rule_act::attribute: return sepol.attribute(a[0]);
+    case rule_act::type_transition: return sepol.type_transition(a[0], a[1], a[2], a[3], a[4]);
+    case rule_act::type_change: return sepol.type_change(a[0], a[1], a[2], a[3]);
+    case rule_act::type_member: return sepol.type_member(a[0], a[1], a[2], a[3]);
+    case rule_act::genfscon: return sepol.genfscon(a[0], a[1], a[2]);
+    case rule_act::create: return sepol.create(a[0]);
+    default: return false;
+    }
+}
+
+#define add_action_func(name, type, act) \
 else if (strcmp(name, action) == 0) {   \
-    auto __fn = [&](auto && ...args){ return (fn)(args...); }; \
+    auto __fn = [&](auto && ...args){ return sink(rule_act::act, args...); }; \
     if (!parse_pattern_##type(__fn, name, remain))             \
         LOGW("Syntax error in '%.*s'\n\n%s\n", len, stmt, type_msg_##type); \
 }
 
 #define add_action(act, type) add_action_func(#act, type, act)
 
-void sepolicy::parse_statement(const char *stmt, int len) {
+// Tokenize and expand a statement, sink is called once per expanded rule
+template <typename Func>
+static void parse_statement(const Func &sink, const char *stmt, int len) {
     // strtok modify strings, create a copy
     string cpy(stmt, len);
 
@@ -310,3 +369,144 @@ void sepolicy::parse_statement(const char *stmt, int len) {
 
     else { LOGW("Unknown action: '%s'\n\n", action); }
 }
+
+void sepolicy::parse_statement(const char *stmt, int len) {
+    ::parse_statement([this](rule_act act, auto ...args) {
+        const char *argv[] = { args... };
+        return exec_rule(*this, act, argv);
+    }, stmt, len);
+}
+
+// Compiled rule files hold the fully expanded statements of a sepolicy.rule,
+// so applying them skips tokenizing and brace expansion entirely.
+// Symbols are stored by name: their values depend on the policy being patched.
+//
+// Layout: header | ops[num_ops] | NUL terminated strings[strtab_sz]
+
+#define RULE_BIN_MAGIC "MGSKRULE"
+#define RULE_BIN_VER   1
+#define RULE_BIN_NULL  UINT32_MAX
+
+struct rule_bin_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_ops;
+    uint32_t strtab_sz;
+    uint32_t reserved;
+};
+
+struct rule_bin_op {
+    uint8_t act;
+    uint8_t argc;
+    uint16_t reserved;
+    uint32_t args[5];   /* Offsets into the string table, RULE_BIN_NULL for '*' */
+};
+
+bool sepolicy::compile_rule_file(const char *in, const char *out) {
+    vector<rule_bin_op> ops;
+    string strtab;
+    map<string, uint32_t, less<>> strs;
+    auto intern = [&](const char *s) -> uint32_t {
+        if (s == nullptr)
+            return RULE_BIN_NULL;
+        auto it = strs.find(string_view(s));
+        if (it != strs.end())
+            return it->second;
+        uint32_t off = strtab.size();
+        strtab.append(s, strlen(s) + 1);
+        strs.emplace(s, off);
+        return off;
+    };
+
+    if (access(in, R_OK) != 0) {
+        PLOGE("Read %s", in);
+        return false;
+    }
+    file_readline(true, in, [&](string_view line) -> bool {
+        if (line.empty() || line[0] == '#')
+            return true;
+        ::parse_statement([&](rule_act act, auto ...args) {
+            rule_bin_op op{};
+            op.act = (uint8_t) act;
+            op.argc = sizeof...(args);
+            uint32_t *arg = op.args;
+            ((*arg++ = intern(args)), ...);
+            ops.push_back(op);
+            return true;
+        }, line.data(), line.size());
+        return true;
+    });
+
+    rule_bin_hdr hdr{};
+    memcpy(hdr.magic, RULE_BIN_MAGIC, sizeof(hdr.magic));
+    hdr.version = RULE_BIN_VER;
+    hdr.num_ops = ops.size();
+    hdr.strtab_sz = strtab.size();
+
+    int fd = xopen(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    size_t ops_sz = ops.size() * sizeof(rule_bin_op);
+    bool ok = xwrite(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+              xwrite(fd, ops.data(), ops_sz) == ops_sz &&
+              xwrite(fd, strtab.data(), strtab.size()) == strtab.size();
+    close(fd);
+    if (!ok)
+        unlink(out);
+    return ok;
+}
+
+string sepolicy::read_compiled_rules(const char *file) {
+    string bin = file + ".bin"s;
+    struct stat st_txt{}, st_bin{};
+    if (stat(file, &st_txt) || stat(bin.data(), &st_bin))
+        return {};
+    // A compiled file older than its source is stale
+    if (st_bin.st_mtim.tv_sec < st_txt.st_mtim.tv_sec ||
+        (st_bin.st_mtim.tv_sec == st_txt.st_mtim.tv_sec &&
+         st_bin.st_mtim.tv_nsec < st_txt.st_mtim.tv_nsec))
+        return {};
+    return full_read(bin.data());
+}
+
+bool sepolicy::load_compiled_rules(const string &data) {
+    rule_bin_hdr hdr;
+    if (data.size() < sizeof(hdr))
+        return false;
+    memcpy(&hdr, data.data(), sizeof(hdr));
+    if (memcmp(hdr.magic, RULE_BIN_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != RULE_BIN_VER ||
+        data.size() != sizeof(hdr) + (uint64_t) hdr.num_ops * sizeof(rule_bin_op) + hdr.strtab_sz)
+        return false;
+
+    vector<rule_bin_op> ops(hdr.num_ops);
+    memcpy(ops.data(), data.data() + sizeof(hdr), hdr.num_ops * sizeof(rule_bin_op));
+    const char *strtab = data.data() + sizeof(hdr) + hdr.num_ops * sizeof(rule_bin_op);
+    if (hdr.strtab_sz && strtab[hdr.strtab_sz - 1] != '\0')
+        return false;
+
+    // Validate everything first, so a corrupted file never leaves the policy half patched
+    for (auto &op : ops) {
+        if (op.act >= (int) rule_act::END || op.argc != act_argc[op.act])
+            return false;
+        for (int i = 0; i < op.argc; ++i)
+            if (op.args[i] != RULE_BIN_NULL && op.args[i] >= hdr.strtab_sz)
+                return false;
+    }
+
+    impl->begin_batch();
+    for (auto &op : ops) {
+        const char *argv[5];
+        for (int i = 0; i < op.argc; ++i)
+            argv[i] = op.args[i] == RULE_BIN_NULL ? nullptr : strtab + op.args[i];
+        if (!exec_rule(*this, (rule_act) op.act, argv)) {
+            string s = rule_names[op.act];
+            for (int i = 0; i < op.argc; ++i) {
+                s += ' ';
+                s += argv[i] ? argv[i] : "*";
+            }
+            LOGW("Error in: %s\n", s.data());
+        }
+    }
+    impl->commit_batch();
+    return true;
+}
@@ -262,6 +262,7 @@ static void magiskd_passthrough(int client) {
 
 extern bool uid_granted_root(int uid);
 static void get_process_info(int client, const sock_cred *cred) {
+    stat_timer t(DaemonStat::ZYGISK_INFO);
     int uid = read_int(client);
     string process = read_string(client);
 
@@ -339,8 +340,7 @@ static void get_moddir(int client) {
     close(dfd);
 }
 
-void zygisk_handler(int client, const sock_cred *cred) {
-    int code = read_int(client);
+static void serve_zygisk(int client, int code, const sock_cred *cred) {
     char buf[256];
     switch (code) {
     case ZygiskRequest::SETUP:
@@ -371,3 +371,23 @@ void zygisk_handler(int client, const sock_cred *cred) {
     }
     close(client);
 }
+
+// Zygisk connections are dequeued before everything else and process info is served
+// right away. The rest is queued again by what it actually does: companion connects
+// also come from app specialization, so only the passthrough fallback is bulk work.
+void zygisk_handler(int client, const sock_cred *cred) {
+    int code = read_int(client);
+    int cls;
+    switch (code) {
+    case ZygiskRequest::GET_INFO:
+        serve_zygisk(client, code, cred);
+        return;
+    case ZygiskRequest::PASSTHROUGH:
+        cls = TaskClass::BULK;
+        break;
+    default:
+        cls = TaskClass::NORMAL;
+        break;
+    }
+    exec_task([=, cred = *cred] { serve_zygisk(client, code, &cred); }, cls);
+}
@@ -221,16 +221,15 @@ done
 if [ -f kernel ]; then
   PATCHEDKERNEL=false
   # Remove Samsung RKP
+  # Remove Samsung defex
+  # Before: [mov w2, #-221]   (-__NR_execve)
+  # After:  [mov w2, #-32768]
   ./magiskboot hexpatch kernel \
   49010054011440B93FA00F71E9000054010840B93FA00F7189000054001840B91FA00F7188010054 \
   A1020054011440B93FA00F7140020054010840B93FA00F71E0010054001840B91FA00F7181010054 \
+  821B8012 E2FF8F12 \
   && PATCHEDKERNEL=true
 
-  # Remove Samsung defex
-  # Before: [mov w2, #-221]   (-__NR_execve)
-  # After:  [mov w2, #-32768]
-  ./magiskboot hexpatch kernel 821B8012 E2FF8F12 && PATCHEDKERNEL=true
-
   # Force kernel to load rootfs for legacy SAR devices
   # skip_initramfs -> want_initramfs
   $SYSTEM_ROOT && ./magiskboot hexpatch kernel \
@@ -650,6 +650,9 @@ copy_preinit_files() {
     local MODNAME=${MODDIR##*/}
     mkdir -p $PREINITDIR/$MODNAME
     cp -f $r $PREINITDIR/$MODNAME/sepolicy.rule
+    # Precompile so magiskinit does not need to parse rules on every boot
+    $(magisk --path)/magiskpolicy --compile-rules $r $PREINITDIR/$MODNAME/sepolicy.rule.bin 2>/dev/null \
+      || rm -f $PREINITDIR/$MODNAME/sepolicy.rule.bin
   done
 }
 